@@ -0,0 +1,340 @@
+/*
+ *   capture.c: tcp/udp reverse proxy for otip: packet capture
+ *
+ *   Copyright 2022 Renzo Davoli - Virtual Square Team
+ *   University of Bologna - Italy
+ *
+ * otip_rproxy is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <strcase.h>
+#include <stropt.h>
+#include <ioth.h>
+#include <utils.h>
+#include <otip_rproxy.h>
+#include <capture.h>
+
+/* The relay threads copy (at most snaplen bytes of) the captured packets
+ * in a preallocated ring. The ring is a bounded lock-free multi-producer
+ * queue: each slot has a sequence number telling whether it is free for
+ * the producer of the current lap or ready for the consumer. When the
+ * ring is full packets are dropped (and counted): the cost for the relay
+ * threads is bounded.
+ * The writer thread drains the ring to a pcapng file. Each relayed packet is
+ * written twice: on the "external" interface (client <-> otip address) and
+ * on the "internal" one (internal stack <-> server). IPv6 and TCP/UDP headers
+ * are synthesized, checksums are not computed. */
+
+#define CAPTURE_DEFAULT_SLOTS 4096
+#define CAPTURE_MAX_SLOTS (1 << 20)
+#define CAPTURE_DEFAULT_SNAPLEN 256
+/* max payload of a (non jumbo) IPv6 packet */
+#define CAPTURE_MAX_SNAPLEN 65535
+#define CAPTURE_IDLE_US 10000
+
+#define LINKTYPE_IPV6 229
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_MAGIC 0x1A2B3C4D
+#define IFACE_EXT 0
+#define IFACE_INT 1
+
+#define IPV6_HDRLEN 40
+#define UDP_HDRLEN 8
+#define TCP_HDRLEN 20
+#define MAX_HDRLEN (IPV6_HDRLEN + TCP_HDRLEN)
+
+_Atomic int capture_active;
+
+struct capture_slot {
+	_Atomic uint64_t seq;
+	uint64_t ts_us;
+	uint8_t proto;
+	uint8_t dir;
+	uint32_t len;
+	uint32_t caplen;
+	uint32_t tcpseq;
+	uint32_t tcpack;
+	struct sockaddr_in6 ext_peer;
+	struct sockaddr_in6 ext_local;
+	struct sockaddr_in6 int_local;
+	struct sockaddr_in6 int_peer;
+	uint8_t data[];
+};
+
+static char *capture_path;
+static unsigned int capture_sample = 1;
+static in_port_t capture_port;
+static uint32_t capture_snaplen = CAPTURE_DEFAULT_SNAPLEN;
+static uint64_t capture_slots = CAPTURE_DEFAULT_SLOTS;
+static size_t slot_size;
+static uint8_t *ring;
+/* MAX_HDRLEN + snaplen bytes: the stack of the writer thread can be small */
+static uint8_t *pktbuf;
+static _Atomic uint64_t ring_head;
+static uint64_t ring_tail;
+
+static inline struct capture_slot *ring_slot(uint64_t pos) {
+	return (struct capture_slot *) (ring + (pos & (capture_slots - 1)) * slot_size);
+}
+
+/* reserve a slot: NULL if the ring is full */
+static struct capture_slot *ring_reserve(void) {
+	uint64_t pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	for (;;) {
+		struct capture_slot *slot = ring_slot(pos);
+		uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		int64_t diff = (int64_t) (seq - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring_head, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+				return slot;
+		} else if (diff < 0)
+			return NULL;
+		else
+			pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	}
+}
+
+static inline uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void flow_init(struct capture_flow *flow) {
+	socklen_t len = sizeof(flow->ext_sock);
+	memset(&flow->ext_sock, 0, sizeof(flow->ext_sock));
+	memset(&flow->int_sock, 0, sizeof(flow->int_sock));
+	ioth_getsockname(flow->extfd, (struct sockaddr *) &flow->ext_sock, &len);
+	if (flow->ext_local != NULL)
+		flow->ext_sock.sin6_addr = *flow->ext_local;
+	len = sizeof(flow->int_sock);
+	ioth_getsockname(flow->intfd, (struct sockaddr *) &flow->int_sock, &len);
+	flow->init = 1;
+}
+
+void capture_packet(struct capture_flow *flow, int dir, const void *buf, size_t len) {
+	static __thread unsigned int sample_count;
+	uint32_t tcpseq = flow->seq[dir];
+	/* tcp sequence numbers count the bytes relayed since the capture began */
+	flow->seq[dir] += len;
+	if (capture_port != 0 && flow->extport != capture_port)
+		return;
+	if (capture_sample > 1 && ++sample_count % capture_sample != 0)
+		return;
+	if (!flow->init)
+		flow_init(flow);
+	struct capture_slot *slot = ring_reserve();
+	if (slot == NULL) {
+		otip_stats.capture_dropped++;
+		return;
+	}
+	slot->ts_us = now_us();
+	slot->proto = flow->proto;
+	slot->dir = dir;
+	slot->len = len;
+	slot->caplen = len < capture_snaplen ? len : capture_snaplen;
+	slot->tcpseq = tcpseq;
+	slot->tcpack = flow->seq[1 - dir];
+	slot->ext_peer = *flow->ext_peer;
+	slot->ext_local = flow->ext_sock;
+	slot->int_local = flow->int_sock;
+	slot->int_peer = *flow->int_peer;
+	memcpy(slot->data, buf, slot->caplen);
+	uint64_t pos = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	otip_stats.capture_packets++;
+}
+
+/* pcapng output */
+static void pcapng_block(FILE *f, uint32_t type, const void *body, size_t len,
+		const void *data, size_t datalen) {
+	static const uint8_t pad[4];
+	size_t padlen = (4 - (datalen % 4)) % 4;
+	uint32_t total = 12 + len + datalen + padlen;
+	fwrite(&type, sizeof(type), 1, f);
+	fwrite(&total, sizeof(total), 1, f);
+	fwrite(body, len, 1, f);
+	if (datalen > 0)
+		fwrite(data, datalen, 1, f);
+	if (padlen > 0)
+		fwrite(pad, padlen, 1, f);
+	fwrite(&total, sizeof(total), 1, f);
+}
+
+static void pcapng_header(FILE *f) {
+	struct {
+		uint32_t magic;
+		uint16_t major;
+		uint16_t minor;
+		int64_t section_len;
+	} shb = {PCAPNG_MAGIC, 1, 0, -1};
+	pcapng_block(f, PCAPNG_SHB, &shb, sizeof(shb), NULL, 0);
+	struct {
+		uint16_t linktype;
+		uint16_t reserved;
+		uint32_t snaplen;
+	} idb = {LINKTYPE_IPV6, 0, capture_snaplen + MAX_HDRLEN};
+	pcapng_block(f, PCAPNG_IDB, &idb, sizeof(idb), NULL, 0); // IFACE_EXT
+	pcapng_block(f, PCAPNG_IDB, &idb, sizeof(idb), NULL, 0); // IFACE_INT
+}
+
+static inline void put16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8; p[1] = v;
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void pcapng_packet(FILE *f, int iface, struct capture_slot *slot,
+		struct sockaddr_in6 *src, struct sockaddr_in6 *dst) {
+	uint8_t *pkt = pktbuf;
+	size_t l4len = (slot->proto == IPPROTO_TCP) ? TCP_HDRLEN : UDP_HDRLEN;
+	size_t hdrlen = IPV6_HDRLEN + l4len;
+	size_t payload = l4len + slot->len;
+	memset(pkt, 0, hdrlen);
+	pkt[0] = 0x60;
+	put16(pkt + 4, payload > 0xffff ? 0xffff : payload);
+	pkt[6] = slot->proto;
+	pkt[7] = 64;
+	memcpy(pkt + 8, &src->sin6_addr, sizeof(struct in6_addr));
+	memcpy(pkt + 24, &dst->sin6_addr, sizeof(struct in6_addr));
+	uint8_t *l4 = pkt + IPV6_HDRLEN;
+	memcpy(l4, &src->sin6_port, 2);
+	memcpy(l4 + 2, &dst->sin6_port, 2);
+	if (slot->proto == IPPROTO_TCP) {
+		put32(l4 + 4, slot->tcpseq);
+		put32(l4 + 8, slot->tcpack);
+		l4[12] = (TCP_HDRLEN / 4) << 4;
+		l4[13] = 0x18; // PSH ACK
+		put16(l4 + 14, 0xffff);
+	} else
+		put16(l4 + 4, payload > 0xffff ? 0 : payload);
+	memcpy(pkt + hdrlen, slot->data, slot->caplen);
+	struct {
+		uint32_t iface;
+		uint32_t ts_high;
+		uint32_t ts_low;
+		uint32_t caplen;
+		uint32_t len;
+	} epb = {iface, slot->ts_us >> 32, slot->ts_us, hdrlen + slot->caplen, hdrlen + slot->len};
+	pcapng_block(f, PCAPNG_EPB, &epb, sizeof(epb), pkt, hdrlen + slot->caplen);
+}
+
+static void *capture_writer(void *arg) {
+	(void) arg;
+	FILE *f = NULL;
+	for (;;) {
+		struct capture_slot *slot = ring_slot(ring_tail);
+		uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq == ring_tail + 1) {
+			if (f == NULL && (f = fopen(capture_path, "a")) != NULL)
+				pcapng_header(f);
+			if (f != NULL) {
+				if (slot->dir == CAPTURE_EXT2INT) {
+					pcapng_packet(f, IFACE_EXT, slot, &slot->ext_peer, &slot->ext_local);
+					pcapng_packet(f, IFACE_INT, slot, &slot->int_local, &slot->int_peer);
+				} else {
+					pcapng_packet(f, IFACE_INT, slot, &slot->int_peer, &slot->int_local);
+					pcapng_packet(f, IFACE_EXT, slot, &slot->ext_local, &slot->ext_peer);
+				}
+			}
+			atomic_store_explicit(&slot->seq, ring_tail + capture_slots, memory_order_release);
+			ring_tail++;
+		} else {
+			/* ring empty: close the file when the capture has been stopped */
+			if (f != NULL) {
+				if (capturing())
+					fflush(f);
+				else {
+					fclose(f);
+					f = NULL;
+				}
+			}
+			usleep(CAPTURE_IDLE_US);
+		}
+	}
+	return NULL;
+}
+
+int capture_set(char *spec, char *cwd) {
+	int start = 0;
+	int tagc = stropt(spec, NULL, NULL, NULL);
+	if (tagc > 0) {
+		char buf[strlen(spec)+1];
+		char *tags[tagc];
+		char *args[tagc];
+		stropt(spec, tags, args, buf);
+		for (int i=0; i < tagc - 1; i++) {
+			long value = args[i] ? strtol(args[i], NULL, 0) : 1;
+			switch(strcase(tags[i])) {
+				case STRCASE(f,i,l,e): capture_path = args[i] ? strdup(args[i]) : NULL; break;
+				case STRCASE(s,a,m,p,l,e): capture_sample = value > 1 ? value : 1; break;
+				case STRCASE(p,o,r,t): capture_port = value; break;
+				case STRCASE(s,n,a,p,l,e,n):
+					capture_snaplen = (value > 0 && value <= CAPTURE_MAX_SNAPLEN) ? value : 0; break;
+				case STRCASE(s,l,o,t,s):
+					capture_slots = (value >= 2 && value <= CAPTURE_MAX_SLOTS) ? value : 0; break;
+				case STRCASE(s,t,a,r,t): start = value; break;
+				default: printlog(LOG_ERR, "capture: unknown tag %s", tags[i]);
+					return -1;
+			}
+		}
+	}
+	if (capture_path == NULL || capture_snaplen == 0 || capture_slots < 2) {
+		printlog(LOG_ERR, "capture: invalid configuration %s", spec);
+		return -1;
+	}
+	/* the file is opened later, after daemon() */
+	if (capture_path[0] != '/') {
+		char *path;
+		if (asprintf(&path, "%s/%s", cwd, capture_path) < 0)
+			return -1;
+		free(capture_path);
+		capture_path = path;
+	}
+	/* the number of slots is rounded up to a power of two */
+	while (capture_slots & (capture_slots - 1))
+		capture_slots += capture_slots & -capture_slots;
+	slot_size = (sizeof(struct capture_slot) + capture_snaplen + 7) & ~7UL;
+	ring = calloc(capture_slots, slot_size);
+	pktbuf = malloc(MAX_HDRLEN + capture_snaplen);
+	if (ring == NULL || pktbuf == NULL)
+		return -1;
+	for (uint64_t pos = 0; pos < capture_slots; pos++)
+		atomic_init(&ring_slot(pos)->seq, pos);
+	if (spawn_thread(capture_writer, NULL) != 0)
+		return -1;
+	capture_active = start;
+	return 0;
+}
+
+void capture_toggle(void) {
+	if (ring != NULL)
+		capture_active = !capture_active;
+}
@@ -0,0 +1,51 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+/* packet capture of the relayed data (pcapng).
+ * capture_active is checked inline: when the capture is off the
+ * relay paths pay a single (relaxed) atomic load */
+extern _Atomic int capture_active;
+
+#define CAPTURE_EXT2INT 0
+#define CAPTURE_INT2EXT 1
+
+/* addressing of a relayed session.
+ * Local addresses are retrieved from extfd and intfd (getsockname) when
+ * the first packet is captured; ext_local (if not NULL) is the
+ * external local address (for udp sockets bound to any) */
+struct capture_flow {
+	uint8_t proto;
+	in_port_t extport;
+	int extfd;
+	int intfd;
+	const struct sockaddr_in6 *ext_peer;
+	const struct sockaddr_in6 *int_peer;
+	const struct in6_addr *ext_local;
+	int init;
+	struct sockaddr_in6 ext_sock;
+	struct sockaddr_in6 int_sock;
+	uint32_t seq[2];
+};
+
+/* spec: file=<path>,sample=<n>,port=<extport>,snaplen=<bytes>,slots=<n>,start
+ * a relative path refers to cwd */
+int capture_set(char *spec, char *cwd);
+
+/* start/stop the capture (SIGUSR1) */
+void capture_toggle(void);
+
+void capture_packet(struct capture_flow *flow, int dir, const void *buf, size_t len);
+
+static inline int capturing(void) {
+	return __builtin_expect(atomic_load_explicit(&capture_active, memory_order_relaxed), 0);
+}
+
+static inline void capture(struct capture_flow *flow, int dir, const void *buf, size_t len) {
+	if (capturing())
+		capture_packet(flow, dir, buf, len);
+}
+
+#endif
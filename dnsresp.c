@@ -0,0 +1,242 @@
+/*
+ *   dnsresp.c: tcp/udp reverse proxy for otip: embedded DNS responder
+ *
+ *   Copyright 2022 Renzo Davoli - Virtual Square Team
+ *   University of Bologna - Italy
+ *
+ * otip_rproxy is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <ioth.h>
+#include <utils.h>
+#include <otip_rproxy.h>
+#include <dnsresp.h>
+
+/* The answers are encoded by dnsresp_update (once per epoch, by the main
+ * loop): a query for the otip name is answered copying the header, the
+ * question of the query (resolvers may check the case of the name)
+ * and the pre-encoded resource record. Only the TTL (the remaining
+ * validity of the address) is computed for each query. */
+
+#define DNS_PORT 53
+#define DNS_MAXMSG 512
+#define DNS_HEADERLEN 12
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_ANY 255
+#define DNS_CLASS_IN 1
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_AA 0x0400
+#define DNS_FLAG_RD 0x0100
+#define DNS_OPCODE_MASK 0x7800
+#define DNS_RCODE_FORMERR 1
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NOTIMP 4
+#define DNS_RCODE_REFUSED 5
+/* name (pointer to the question), type, class, ttl, rdlength, rdata */
+#define DNS_RRLEN (2 + 2 + 2 + 4 + 2 + 16)
+#define DNS_RR_TTL 6
+
+static uint8_t dnsname[256];
+static size_t dnsnamelen;
+
+static struct dnsanswer {
+	time_t start;
+	time_t end;
+	uint8_t rr[DNS_RRLEN];
+} answers[2];
+static pthread_mutex_t answers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void put16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8; p[1] = v;
+}
+
+static inline uint16_t get16(const uint8_t *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+/* dotted name -> DNS wire format (lowercase) */
+static int name_encode(const char *name, uint8_t *buf, size_t size) {
+	size_t len = 0;
+	while (*name) {
+		const char *dot = strchrnul(name, '.');
+		size_t labellen = dot - name;
+		if (labellen == 0 || labellen > 63 || len + labellen + 2 > size)
+			return -1;
+		buf[len++] = labellen;
+		for (size_t i = 0; i < labellen; i++)
+			buf[len++] = tolower((unsigned char) name[i]);
+		name = (*dot) ? dot + 1 : dot;
+	}
+	buf[len++] = 0;
+	return len;
+}
+
+void dnsresp_update(const struct in6_addr *addr, time_t start, time_t end) {
+	struct dnsanswer answer = {.start = start, .end = end};
+	put16(answer.rr, 0xc000 | DNS_HEADERLEN);
+	put16(answer.rr + 2, DNS_TYPE_AAAA);
+	put16(answer.rr + 4, DNS_CLASS_IN);
+	put16(answer.rr + 10, sizeof(*addr));
+	memcpy(answer.rr + 12, addr, sizeof(*addr));
+	pthread_mutex_lock(&answers_mutex);
+	/* replace the oldest answer */
+	if (answers[0].end < answers[1].end)
+		answers[0] = answer;
+	else
+		answers[1] = answer;
+	pthread_mutex_unlock(&answers_mutex);
+}
+
+/* compare the name of the question with dnsname: return 1 if it matches,
+ * 0 if it does not, -1 if malformed. *namelen is the length of the name */
+static int name_match(const uint8_t *msg, size_t len, size_t *namelen) {
+	size_t pos = DNS_HEADERLEN;
+	int match = 1;
+	for (;;) {
+		if (pos >= len)
+			return -1;
+		uint8_t labellen = msg[pos];
+		if (labellen > 63)
+			return -1; // no compression in questions
+		if (pos - DNS_HEADERLEN + labellen + 1 > sizeof(dnsname) || pos + labellen >= len)
+			return -1;
+		if (match) {
+			size_t npos = pos - DNS_HEADERLEN;
+			if (npos >= dnsnamelen || dnsname[npos] != labellen)
+				match = 0;
+			else
+				for (size_t i = 1; i <= labellen && match; i++)
+					match = tolower(msg[pos + i]) == dnsname[npos + i];
+		}
+		pos += labellen + 1;
+		if (labellen == 0)
+			break;
+	}
+	*namelen = pos - DNS_HEADERLEN;
+	return match && *namelen == dnsnamelen;
+}
+
+/* return the length of the reply, 0 if the query has to be ignored */
+static size_t dnsresp_reply(const uint8_t *msg, size_t len, uint8_t *out) {
+	if (len < DNS_HEADERLEN)
+		return 0;
+	uint16_t flags = get16(msg + 2);
+	if (flags & DNS_FLAG_QR)
+		return 0;
+	memcpy(out, msg, 2); // id
+	memset(out + 2, 0, DNS_HEADERLEN - 2);
+	flags = DNS_FLAG_QR | DNS_FLAG_AA | (flags & (DNS_OPCODE_MASK | DNS_FLAG_RD));
+	if ((flags & DNS_OPCODE_MASK) != 0) {
+		put16(out + 2, flags | DNS_RCODE_NOTIMP);
+		return DNS_HEADERLEN;
+	}
+	size_t namelen;
+	int match;
+	if (get16(msg + 4) != 1 || (match = name_match(msg, len, &namelen)) < 0 ||
+			DNS_HEADERLEN + namelen + 4 > len) {
+		put16(out + 2, flags | DNS_RCODE_FORMERR);
+		return DNS_HEADERLEN;
+	}
+	size_t qlen = namelen + 4;
+	uint16_t qtype = get16(msg + DNS_HEADERLEN + namelen);
+	uint16_t qclass = get16(msg + DNS_HEADERLEN + namelen + 2);
+	put16(out + 4, 1);
+	memcpy(out + DNS_HEADERLEN, msg + DNS_HEADERLEN, qlen);
+	size_t outlen = DNS_HEADERLEN + qlen;
+	if (!match || qclass != DNS_CLASS_IN) {
+		put16(out + 2, (flags & ~DNS_FLAG_AA) | DNS_RCODE_REFUSED);
+		return outlen;
+	}
+	if (qtype != DNS_TYPE_AAAA && qtype != DNS_TYPE_ANY) {
+		/* NODATA */
+		put16(out + 2, flags);
+		return outlen;
+	}
+	time_t now = time(NULL);
+	int found = 0;
+	pthread_mutex_lock(&answers_mutex);
+	for (int i = 0; i < 2; i++) {
+		if (answers[i].start <= now && now < answers[i].end) {
+			memcpy(out + outlen, answers[i].rr, DNS_RRLEN);
+			put32(out + outlen + DNS_RR_TTL, answers[i].end - now);
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&answers_mutex);
+	if (!found) {
+		put16(out + 2, flags | DNS_RCODE_SERVFAIL);
+		return outlen;
+	}
+	put16(out + 2, flags);
+	put16(out + 6, 1);
+	return outlen + DNS_RRLEN;
+}
+
+static void *dnsresp_thread(void *arg) {
+	int fd = (intptr_t) arg;
+	uint8_t msg[DNS_MAXMSG];
+	uint8_t out[DNS_MAXMSG];
+	for (;;) {
+		struct sockaddr_in6 from;
+		socklen_t fromlen = sizeof(from);
+		ssize_t len = ioth_recvfrom(fd, msg, sizeof(msg), 0, (struct sockaddr *) &from, &fromlen);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			printlog(LOG_ERR, "dns responder: %s", strerror(errno));
+			break;
+		}
+		otip_stats.dns_queries++;
+		size_t outlen = dnsresp_reply(msg, len, out);
+		if (outlen > 0)
+			ioth_sendto(fd, out, outlen, 0, (struct sockaddr *) &from, fromlen);
+	}
+	ioth_close(fd);
+	return NULL;
+}
+
+int dnsresp_start(struct ioth *stack, const char *name) {
+	struct sockaddr_in6 bindaddr = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = in6addr_any,
+		.sin6_port = htons(DNS_PORT)
+	};
+	int len = name_encode(name, dnsname, sizeof(dnsname));
+	if (len < 0)
+		return errno = EINVAL, -1;
+	dnsnamelen = len;
+	int fd = ioth_msocket(stack, AF_INET6, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	if (ioth_bind(fd, (struct sockaddr *) &bindaddr, sizeof(bindaddr)) < 0 ||
+			spawn_thread(dnsresp_thread, (void *) (intptr_t) fd) != 0) {
+		ioth_close(fd);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef DNSRESP_H
+#define DNSRESP_H
+#include <time.h>
+#include <netinet/in.h>
+#include <ioth.h>
+
+/* authoritative responder for the AAAA record of the otip name.
+ * It listens on UDP port 53 of stack */
+int dnsresp_start(struct ioth *stack, const char *name);
+
+/* set the (pre-encoded) answer for the epoch [start, end):
+ * the current and the next epochs are kept */
+void dnsresp_update(const struct in6_addr *addr, time_t start, time_t end);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ *   flowlog.c: tcp/udp reverse proxy for otip: flow records
+ *
+ *   Copyright 2022 Renzo Davoli - Virtual Square Team
+ *   University of Bologna - Italy
+ *
+ * otip_rproxy is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include <strcase.h>
+#include <stropt.h>
+#include <utils.h>
+#include <otip_rproxy.h>
+#include <flowlog.h>
+
+/* A record is written by the thread closing the session: an atomic
+ * increment reserves the slot, no locks, no allocations, no system calls.
+ * The kernel writes the dirty pages of the mapping back to the file.
+ * seq is cleared while the record is being written: readers check it
+ * before and after reading a record. */
+
+#define FLOWLOG_DEFAULT_RECORDS 65536
+
+static struct flowlog_header *flowlog;
+static struct flowrec *records;
+
+uint64_t flowlog_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void flowlog_record(uint8_t proto, const struct proxy_item *item, const struct sockaddr_in6 *client,
+		uint32_t epoch, uint64_t start_ms, const struct flowstat *stat, int reason) {
+	if (flowlog == NULL)
+		return;
+	uint64_t index = atomic_fetch_add_explicit(&flowlog->next, 1, memory_order_relaxed);
+	struct flowrec *rec = &records[index % flowlog->nrecords];
+	atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	rec->start_ms = htobe64(start_ms);
+	rec->end_ms = htobe64(flowlog_now_ms());
+	memcpy(rec->client, &client->sin6_addr, sizeof(rec->client));
+	memcpy(rec->server, &item->intsockaddr.sin6_addr, sizeof(rec->server));
+	rec->client_port = client->sin6_port;
+	rec->extport = htons(item->extport);
+	rec->server_port = item->intsockaddr.sin6_port;
+	rec->proto = proto;
+	rec->reason = reason;
+	rec->epoch = htonl(epoch);
+	for (int dir = 0; dir < 2; dir++) {
+		rec->bytes[dir] = htobe64(stat->bytes[dir]);
+		rec->pkts[dir] = htobe64(stat->pkts[dir]);
+	}
+	atomic_store_explicit(&rec->seq, (uint32_t) (index + 1), memory_order_release);
+}
+
+int flowlog_set(char *spec, char *cwd) {
+	char *path = NULL;
+	uint64_t nrecords = FLOWLOG_DEFAULT_RECORDS;
+	int tagc = stropt(spec, NULL, NULL, NULL);
+	if (tagc > 0) {
+		char buf[strlen(spec)+1];
+		char *tags[tagc];
+		char *args[tagc];
+		stropt(spec, tags, args, buf);
+		for (int i=0; i < tagc - 1; i++) {
+			switch(strcase(tags[i])) {
+				case STRCASE(f,i,l,e): path = args[i]; break;
+				case STRCASE(r,e,c,o,r,d,s): nrecords = args[i] ? strtoull(args[i], NULL, 0) : 0; break;
+				default: printlog(LOG_ERR, "flowlog: unknown tag %s", tags[i]);
+					return -1;
+			}
+		}
+		if (path == NULL || nrecords == 0) {
+			printlog(LOG_ERR, "flowlog: invalid configuration %s", spec);
+			return -1;
+		}
+		size_t size = sizeof(struct flowlog_header) + nrecords * sizeof(struct flowrec);
+		/* flowlog_set runs after daemon() */
+		char path_buf[PATH_MAX];
+		if (path[0] != '/') {
+			snprintf(path_buf, PATH_MAX, "%s/%s", cwd, path);
+			path = path_buf;
+		}
+		int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			printlog(LOG_ERR, "flowlog %s: %s", path, strerror(errno));
+			return -1;
+		}
+		/* an existing ring with the same geometry is continued */
+		struct flowlog_header header;
+		int reuse = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+			memcmp(header.magic, FLOWLOG_MAGIC, sizeof(header.magic)) == 0 &&
+			header.version == FLOWLOG_VERSION && header.recsize == sizeof(struct flowrec) &&
+			header.nrecords == nrecords;
+		if ((!reuse && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)) ||
+				(flowlog = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			printlog(LOG_ERR, "flowlog %s: %s", path, strerror(errno));
+			flowlog = NULL;
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		records = (struct flowrec *) (flowlog + 1);
+		if (!reuse) {
+			memcpy(flowlog->magic, FLOWLOG_MAGIC, sizeof(flowlog->magic));
+			flowlog->version = FLOWLOG_VERSION;
+			flowlog->recsize = sizeof(struct flowrec);
+			flowlog->nrecords = nrecords;
+			atomic_init(&flowlog->next, 0);
+		}
+		return 0;
+	}
+	printlog(LOG_ERR, "flowlog: invalid configuration %s", spec);
+	return -1;
+}
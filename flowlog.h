@@ -0,0 +1,79 @@
+#ifndef FLOWLOG_H
+#define FLOWLOG_H
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+/* flow records of finished tcp connections and udp flows.
+ * The records are written in a memory mapped file used as a ring:
+ * a header followed by nrecords fixed size records.
+ * Numeric fields of the records are in network byte order (as in IPFIX),
+ * seq and the header are in host byte order. */
+
+#define FLOWLOG_MAGIC "OTIPFLOW"
+#define FLOWLOG_VERSION 1
+
+struct flowlog_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t recsize;
+	uint64_t nrecords;
+	/* number of records written so far: the next record is
+	 * records[next % nrecords] */
+	_Atomic uint64_t next;
+	uint8_t reserved[32];
+};
+
+/* end reasons (IPFIX flowEndReason) */
+#define FLOW_END_IDLE 1       /* idle timeout */
+#define FLOW_END_ACTIVE 2     /* max age (session_maxage) */
+#define FLOW_END_CLOSED 3     /* closed by an endpoint (udp: reply sent in shared mode) */
+#define FLOW_END_FORCED 4     /* stack reaped */
+#define FLOW_END_NORESOURCE 5 /* server unreachable, queue timeout */
+
+struct flowrec {
+	uint64_t start_ms;
+	uint64_t end_ms;
+	uint8_t client[16];
+	uint8_t server[16];
+	uint16_t client_port;
+	uint16_t extport;
+	uint16_t server_port;
+	uint8_t proto;
+	uint8_t reason;
+	uint32_t epoch;
+	/* (record index + 1), 0 while the record is being written */
+	_Atomic uint32_t seq;
+	/* [0]: client -> server, [1]: server -> client */
+	uint64_t bytes[2];
+	uint64_t pkts[2];
+};
+
+_Static_assert(sizeof(struct flowlog_header) == 64, "flowlog header size");
+_Static_assert(sizeof(struct flowrec) == 96, "flowlog record size");
+
+#define FLOW_EXT2INT 0
+#define FLOW_INT2EXT 1
+
+/* per session counters */
+struct flowstat {
+	uint64_t bytes[2];
+	uint64_t pkts[2];
+};
+
+static inline void flowstat_add(struct flowstat *stat, int dir, size_t len, size_t pkts) {
+	stat->bytes[dir] += len;
+	stat->pkts[dir] += pkts;
+}
+
+struct proxy_item;
+/* spec: file=<path>[,records=<n>]
+ * a relative path refers to cwd */
+int flowlog_set(char *spec, char *cwd);
+
+uint64_t flowlog_now_ms(void);
+
+void flowlog_record(uint8_t proto, const struct proxy_item *item, const struct sockaddr_in6 *client,
+		uint32_t epoch, uint64_t start_ms, const struct flowstat *stat, int reason);
+
+#endif
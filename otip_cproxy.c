@@ -0,0 +1,495 @@
+/*
+ *   otip_cproxy.c: client side OTIP forwarder
+ *
+ *   Copyright 2022 Renzo Davoli - Virtual Square Team
+ *   University of Bologna - Italy
+ *
+ * otip_cproxy is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* otip_cproxy listens on local TCP ports and forwards the connections
+ * to the current OTIP address of a server (usually an otip_rproxy).
+ * The current and the next addresses are precomputed, and a pool of
+ * connections to the upcoming epoch is opened shortly before the
+ * rollover: local clients get a fixed endpoint and pay neither DNS nor
+ * hash latency at connect time. */
+
+#define SPDX_LICENSE "SPDX-License-Identifier: GPL-2.0-or-later"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ioth.h>
+#include <iothconf.h>
+#include <iothdns.h>
+#include <iothaddr.h>
+#include <utils.h>
+
+#ifndef _GNU_SOURCE
+static inline char *strchrnul(const char *s, int c) {
+  while (*s && *s != c)
+    s++;
+  return (char *) s;
+}
+#endif
+
+#define BASE_TTL 300
+#define RELAY_BUFSIZE 16384
+
+static int otip_period = 32;
+static int conf_preopen = 4;
+static int conf_pool = 4;
+
+/* the stack used to reach the server */
+static struct ioth *stack;
+static char *otipname;
+static char *otippasswd;
+
+/* precomputed addresses: epoch[0] is the current epoch, epoch[1] the next */
+static struct epoch {
+	uint32_t otiptime;
+	struct in6_addr addr;
+} epoch[2];
+static pthread_mutex_t epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* pre-opened connection */
+struct pooled {
+	int fd;
+	uint32_t otiptime;
+};
+
+struct mapping {
+	in_port_t localport;
+	in_port_t remoteport;
+	int lfd;
+	pthread_mutex_t lock;
+	int npooled;
+	struct pooled *pool;
+};
+static struct mapping *mappings;
+static int nmappings;
+
+/* Main and command line args management */
+void usage(char *progname)
+{
+	fprintf(stderr,"Usage: %s OPTIONS name password localport,remoteport ...\n"
+			"\tOPTIONS:\n"
+			"\t--base|--baseaddr|-b <IPv6 base address or base addr domain name>\n"
+			"\t--dns|-D <dnsaddr>\n"
+			"\t--dnsstack|-s <ioth_stack_conf>\n"
+			"\t--stack|-x <ioth_stack_conf>\n"
+			"\t--listen|-l <local IPv6 address>\n"
+			"\t--period|-T <otip_period>\n"
+			"\t--preopen|-o <seconds>\n"
+			"\t--pool|-n <count>\n"
+			"\t--daemon|-d\n"
+			"\t--pidfile|-P <pidfile>\n"
+			"\t--verbose|-v\n"
+			"\t--help|-h\n",
+			progname);
+	exit(1);
+}
+
+static char *short_options = "hdvb:s:D:x:l:T:o:n:P:";
+static struct option long_options[] = {
+	{"help", 0, 0, 'h'},
+	{"base", 1, 0, 'b'},
+	{"baseaddr", 1, 0, 'b'},
+	{"dnsstack", 1, 0, 's'},
+	{"dns", 1, 0, 'D'},
+	{"stack", 1, 0, 'x'},
+	{"listen", 1, 0, 'l'},
+	{"period", 1, 0, 'T'},
+	{"preopen", 1, 0, 'o'},
+	{"pool", 1, 0, 'n'},
+	{"daemon", 0, 0, 'd'},
+	{"pidfile", 1, 0, 'P'},
+	{"verbose", 0, 0, 'v'},
+	{0,0,0,0}
+};
+
+static char arg_tags[] = "bsDxlTonPdv";
+static union {
+	struct {
+		char *baseaddr;
+		char *dnsstack;
+		char *dns;
+		char *stack;
+		char *listen;
+		char *period;
+		char *preopen;
+		char *pool;
+		char *pidfile;
+		char *daemon;
+		char *verbose;
+	};
+	char *argv[sizeof(arg_tags)];
+} args;
+
+static inline int argindex(char tag) {
+	return strchrnul(arg_tags, tag) - arg_tags;
+}
+
+/* base address: numeric or resolved (and refreshed every BASE_TTL seconds) */
+static struct in6_addr baseaddr;
+static time_t base_expire;
+static struct iothdns *iothdns;
+
+static int update_base(void) {
+	time_t now = time(NULL);
+	if (now < base_expire)
+		return 0;
+	if (args.baseaddr != NULL && strchr(args.baseaddr, ':') != NULL) {
+		if (inet_pton(AF_INET6, args.baseaddr, &baseaddr) != 1) {
+			printlog(LOG_ERR, "invalid base address: %s", args.baseaddr);
+			return -1;
+		}
+		base_expire = INT64_MAX;
+		return 0;
+	}
+	char *domain = args.baseaddr;
+	if (domain == NULL) {
+		char *name2base = strchr(otipname, '.');
+		if (name2base == NULL) {
+			printlog(LOG_ERR, "missing domain name: %s", otipname);
+			return -1;
+		}
+		domain = name2base + 1;
+	}
+	if (iothdns == NULL) {
+		struct ioth *dnsstack = ioth_newstackc(args.dnsstack);
+		iothdns = iothdns_init_strcfg(dnsstack, args.dns);
+	}
+	struct in6_addr addr;
+	if (iothdns == NULL || iothdns_lookup_aaaa(iothdns, domain, &addr, 1) != 1) {
+		/* keep using the previous base address (if any) */
+		printlog(LOG_WARNING, "domain name base address not found: %s", domain);
+		return base_expire == 0 ? -1 : 0;
+	}
+	baseaddr = addr;
+	base_expire = now + BASE_TTL;
+	return 0;
+}
+
+/* recompute the addresses of the current and next epochs when the epoch changes */
+static void update_epoch(uint32_t otiptime) {
+	if (otiptime == epoch[0].otiptime)
+		return;
+	update_base();
+	struct epoch new[2];
+	for (int i = 0; i < 2; i++) {
+		new[i].otiptime = otiptime + i;
+		new[i].addr = baseaddr;
+		iothaddr_hash(&new[i].addr, otipname, otippasswd, otiptime + i);
+	}
+	pthread_mutex_lock(&epoch_mutex);
+	epoch[0] = new[0];
+	epoch[1] = new[1];
+	pthread_mutex_unlock(&epoch_mutex);
+	if (args.verbose) {
+		char abuf[INET6_ADDRSTRLEN];
+		printlog(LOG_INFO, "epoch %u: %s", otiptime,
+				inet_ntop(AF_INET6, &new[0].addr, abuf, INET6_ADDRSTRLEN));
+	}
+}
+
+static int otip_connect(struct in6_addr *addr, in_port_t port) {
+	struct sockaddr_in6 sin6 = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = *addr,
+		.sin6_port = htons(port)
+	};
+	int fd = ioth_msocket(stack, AF_INET6, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (ioth_connect(fd, (struct sockaddr *) &sin6, sizeof(sin6)) < 0) {
+		ioth_close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* a pooled connection is still usable if the peer has not closed it */
+static int pooled_alive(int fd) {
+	char c;
+	ssize_t n = ioth_recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/* take a pre-opened connection (the most recent epoch first),
+ * or connect on demand to the current address */
+static int mapping_getconn(struct mapping *map) {
+	int fd = -1;
+	pthread_mutex_lock(&map->lock);
+	while (fd < 0 && map->npooled > 0) {
+		int best = 0;
+		for (int i = 1; i < map->npooled; i++)
+			if (map->pool[i].otiptime > map->pool[best].otiptime)
+				best = i;
+		fd = map->pool[best].fd;
+		map->pool[best] = map->pool[--map->npooled];
+		if (!pooled_alive(fd)) {
+			ioth_close(fd);
+			fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&map->lock);
+	if (fd < 0) {
+		struct in6_addr addr;
+		pthread_mutex_lock(&epoch_mutex);
+		addr = epoch[0].addr;
+		pthread_mutex_unlock(&epoch_mutex);
+		fd = otip_connect(&addr, map->remoteport);
+	}
+	return fd;
+}
+
+/* drop the connections of expired epochs, then (if target != NULL)
+ * keep the pool filled with connections to the target epoch */
+static void mapping_refill(struct mapping *map, struct epoch *target, uint32_t current) {
+	int count = 0;
+	pthread_mutex_lock(&map->lock);
+	for (int i = 0; i < map->npooled; ) {
+		if (map->pool[i].otiptime < current || !pooled_alive(map->pool[i].fd)) {
+			ioth_close(map->pool[i].fd);
+			map->pool[i] = map->pool[--map->npooled];
+		} else {
+			if (target != NULL && map->pool[i].otiptime == target->otiptime)
+				count++;
+			i++;
+		}
+	}
+	pthread_mutex_unlock(&map->lock);
+	if (target == NULL)
+		return;
+	/* connect without holding the lock: clients can use the pool meanwhile */
+	for (; count < conf_pool; count++) {
+		int fd = otip_connect(&target->addr, map->remoteport);
+		if (fd < 0) {
+			if (args.verbose)
+				printlog(LOG_WARNING, "preopen port %d: %s", map->remoteport, strerror(errno));
+			break;
+		}
+		pthread_mutex_lock(&map->lock);
+		if (map->npooled < 2 * conf_pool) {
+			map->pool[map->npooled++] = (struct pooled) {fd, target->otiptime};
+			fd = -1;
+		}
+		pthread_mutex_unlock(&map->lock);
+		if (fd >= 0) {
+			ioth_close(fd);
+			break;
+		}
+	}
+}
+
+struct relayarg {
+	int fd;
+	struct mapping *map;
+};
+
+/* relay thread of a local client. It gets the connection to the server
+ * itself: a slow or unreachable server does not stall the accept loop */
+static void *relay(void *arg) {
+	struct relayarg *relayarg = arg;
+	int fd = relayarg->fd;
+	struct mapping *map = relayarg->map;
+	free(relayarg);
+	int rfd = mapping_getconn(map);
+	if (rfd < 0) {
+		printlog(LOG_WARNING, "port %d: cannot reach %s", map->remoteport, otipname);
+		close(fd);
+		return NULL;
+	}
+	char buf[RELAY_BUFSIZE];
+	struct pollfd pfd[] = {{fd, POLLIN, 0}, {rfd, POLLIN, 0}};
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		ssize_t n;
+		if (pfd[0].revents) {
+			if ((n = read(fd, buf, RELAY_BUFSIZE)) <= 0 || ioth_write(rfd, buf, n) != n)
+				break;
+		}
+		if (pfd[1].revents) {
+			if ((n = ioth_read(rfd, buf, RELAY_BUFSIZE)) <= 0 || write(fd, buf, n) != n)
+				break;
+		}
+	}
+	close(fd);
+	ioth_close(rfd);
+	return NULL;
+}
+
+static void *mapping_listen(void *arg) {
+	struct mapping *map = arg;
+	for (;;) {
+		int fd = accept(map->lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			printlog(LOG_ERR, "accept port %d: %s", map->localport, strerror(errno));
+			break;
+		}
+		struct relayarg *relayarg = malloc(sizeof(*relayarg));
+		if (relayarg == NULL) {
+			close(fd);
+			continue;
+		}
+		*relayarg = (struct relayarg) {fd, map};
+		if (spawn_thread(relay, relayarg) != 0) {
+			printlog(LOG_WARNING, "port %d: cannot create relay thread", map->localport);
+			close(fd);
+			free(relayarg);
+		}
+	}
+	return NULL;
+}
+
+static int mapping_init(struct mapping *map, char *spec, struct in6_addr *listenaddr) {
+	unsigned short localport, remoteport;
+	if (sscanf(spec, "%hu,%hu", &localport, &remoteport) != 2) {
+		fprintf(stderr, "invalid mapping: %s\n", spec);
+		return -1;
+	}
+	struct sockaddr_in6 sin6 = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = *listenaddr,
+		.sin6_port = htons(localport)
+	};
+	int one = 1;
+	*map = (struct mapping) {
+		.localport = localport,
+		.remoteport = remoteport,
+		.lfd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0),
+		.pool = calloc(2 * conf_pool, sizeof(struct pooled))
+	};
+	pthread_mutex_init(&map->lock, NULL);
+	if (map->lfd < 0 || map->pool == NULL ||
+			setsockopt(map->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+			bind(map->lfd, (struct sockaddr *) &sin6, sizeof(sin6)) < 0 ||
+			listen(map->lfd, SOMAXCONN) < 0) {
+		fprintf(stderr, "listen port %d: %s\n", localport, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	char *progname = basename(argv[0]);
+	int option_index;
+	char *cwd;
+	struct in6_addr listenaddr = in6addr_loopback;
+	while(1) {
+		int c;
+		if ((c = getopt_long (argc, argv, short_options,
+						long_options, &option_index)) < 0)
+			break;
+		switch (c) {
+			case -1:
+			case '?':
+			case 'h': usage(progname); break;
+			default: {
+								 int index = argindex(c);
+								 if (args.argv[index] == NULL)
+									 args.argv[index] = optarg ? optarg : "";
+							 }
+							 break;
+		}
+	}
+	if (argc < optind + 3)
+		usage(progname);
+	otipname = argv[optind];
+	otippasswd = argv[optind + 1];
+
+	if (args.period) otip_period = strtol(args.period, NULL, 0);
+	if (args.preopen) conf_preopen = strtol(args.preopen, NULL, 0);
+	if (args.pool) conf_pool = strtol(args.pool, NULL, 0);
+	if (args.listen && inet_pton(AF_INET6, args.listen, &listenaddr) != 1) {
+		fprintf(stderr, "invalid listen address: %s\n", args.listen);
+		exit(1);
+	}
+
+	/* log to stderr until daemon(): update_base and the mapping setup may log errors */
+	startlog(progname, 0);
+	ioth_set_license(SPDX_LICENSE);
+	stack = ioth_newstackc(args.stack ? args.stack : "stack=kernel");
+	if (stack == NULL) {
+		fprintf(stderr, "Error configuring stack %s\n", args.stack ? args.stack : "kernel");
+		exit(1);
+	}
+	if (update_base() < 0)
+		exit(1);
+
+	nmappings = argc - optind - 2;
+	mappings = calloc(nmappings, sizeof(*mappings));
+	if (mappings == NULL)
+		exit(1);
+	for (int i = 0; i < nmappings; i++)
+		if (mapping_init(&mappings[i], argv[optind + 2 + i], &listenaddr) < 0)
+			exit(1);
+
+	startlog(progname, args.daemon != NULL);
+	signal(SIGPIPE, SIG_IGN);
+	if((cwd = getcwd(NULL, 0)) == NULL) {
+		printlog(LOG_ERR, "getcwd: %s", strerror(errno));
+		exit(1);
+	}
+	if (args.daemon && daemon(0, 0)) {
+		printlog(LOG_ERR,"daemon: %s", strerror(errno));
+		exit(1);
+	}
+	if(args.pidfile) save_pidfile(args.pidfile, cwd);
+
+	update_epoch(iothaddr_otiptime(otip_period, 0));
+	for (int i = 0; i < nmappings; i++) {
+		if (spawn_thread(mapping_listen, &mappings[i]) != 0) {
+			printlog(LOG_ERR, "thread creation: %s", strerror(errno));
+			exit(1);
+		}
+	}
+
+	/* epoch keeper: once per second update the addresses and the pools.
+	 * During the last conf_preopen seconds of an epoch the pools are
+	 * filled with connections to the next address; the rest of the time
+	 * no connection is opened in advance (clients connect on demand to the
+	 * current address), the expired ones are dropped */
+	for (;;) {
+		time_t now = time(NULL);
+		uint32_t otiptime = iothaddr_otiptime(otip_period, 0);
+		update_epoch(otiptime);
+		struct epoch target;
+		int preopen = (now + conf_preopen >= (time_t) (otiptime + 1) * otip_period);
+		pthread_mutex_lock(&epoch_mutex);
+		target = epoch[1];
+		pthread_mutex_unlock(&epoch_mutex);
+		for (int i = 0; i < nmappings; i++)
+			mapping_refill(&mappings[i], preopen ? &target : NULL, otiptime);
+		sleep(1);
+	}
+}
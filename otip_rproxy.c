@@ -29,6 +29,8 @@
 #include <libgen.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <net/ethernet.h>
 #include <netinet/icmp6.h>
@@ -41,6 +43,10 @@
 #include <iothaddr.h>
 #include <otip_rproxy.h>
 #include <utils.h>
+#include <ratelimit.h>
+#include <dnsresp.h>
+#include <capture.h>
+#include <flowlog.h>
 
 static int verbose;
 static char *cwd;
@@ -51,7 +57,18 @@ static int conf_otip_postactive = 8;
 int conf_otip_lifetime;
 int conf_tcp_listen_backlog = 5;
 int conf_tcp_timeout = 120;
+int conf_tcp_max_sessions = 0;
+int conf_tcp_overload = TCP_OVERLOAD_REJECT;
+int conf_tcp_queue_len = 64;
+int conf_tcp_queue_timeout = 5;
+int conf_io_uring = 0;
 int conf_udp_timeout = 8;
+int conf_udp_busypoll = 0;
+int conf_max_stacks = 0;
+int conf_session_maxage = 0;
+static int conf_stats = 0;
+
+struct otip_stats otip_stats;
 
 #ifndef _GNU_SOURCE
 static inline char *strchrnul(const char *s, int c) {
@@ -69,12 +86,35 @@ static void terminate(int signum) {
 	exit(0);
 }
 
+/* SIGHUP: reload the configuration (in the main loop) */
+static volatile sig_atomic_t reload_request;
+static void reload(int signum) {
+	(void) signum;
+	reload_request = 1;
+}
+
+static void capture_signal(int signum) {
+	(void) signum;
+	capture_toggle();
+}
+
 static void setsignals(void) {
 	struct sigaction action = {
 		.sa_handler = terminate
 	};
 	sigaction(SIGINT, &action, NULL);
 	sigaction(SIGTERM, &action, NULL);
+	struct sigaction reload_action = {
+		.sa_handler = reload,
+		.sa_flags = SA_RESTART
+	};
+	sigaction(SIGHUP, &reload_action, NULL);
+	/* SIGUSR1: start/stop the packet capture */
+	struct sigaction capture_action = {
+		.sa_handler = capture_signal,
+		.sa_flags = SA_RESTART
+	};
+	sigaction(SIGUSR1, &capture_action, NULL);
 }
 
 /* Main and command line args management */
@@ -87,18 +127,37 @@ void usage(char *progname)
 			"\t--pidfile|-p <pidfile>\n"
 			"\t--extstack|-e <ioth_extstack_conf>\n"
 			"\t--intstack|-i <ioth_stack_conf>\n"
+			"\t--intstack_shards <number>\n"
 			"\t--name|-n <fully qualified name>\n"
 			"\t--base|--baseaddr|-b <base address>\n"
 			"\t--passwd|-P <password>\n"
 			"\t--dns|-D <dnsaddr>\n"
-			"\t--udp|-u <extport>,<intaddr>,<intport>\n"
-			"\t--tcp|-t <extport>,<intaddr>,<intport>\n"
+			"\t--udp|-u <extport>,<intaddr>,<intport>[,<options>]\n"
+			"\t--tcp|-t <extport>,<intaddr>,<intport>[,<options>]\n"
 			"\t--otip_period <period>\n"
 			"\t--otip_postactive <seconds>\n"
 			"\t--otip_preactive <seconds>\n"
+			"\t--max_stacks <number>\n"
 			"\t--tcp_listen_backlog <backlog>\n"
 			"\t--tcp_timeout <seconds>\n"
+			"\t--tcp_max_sessions <number>\n"
+			"\t--tcp_overload reject|queue\n"
+			"\t--tcp_queue_len <number>\n"
+			"\t--tcp_queue_timeout <seconds>\n"
 			"\t--udp_timeout <seconds>\n"
+			"\t--udp_busypoll <usecs>\n"
+			"\t--session_maxage <seconds>\n"
+			"\t--ratelimit_addr <rate>[/<burst>]\n"
+			"\t--ratelimit_net <rate>[/<burst>]\n"
+			"\t--io_uring\n"
+			"\t--dns_responder <ioth_stack_conf>\n"
+			"\t--capture file=<path>[,<options>]\n"
+			"\t--cpus_main <cpulist>\n"
+			"\t--cpus_relay <cpulist>\n"
+			"\t--cpus_intstack <cpulist>\n"
+			"\t--thread_stacksize <bytes>\n"
+			"\t--flowlog file=<path>[,records=<n>]\n"
+			"\t--stats <seconds>\n"
 			"\t--verbose|-v\n"
 			"\t--help|-h\n"
 			"\n"
@@ -127,13 +186,32 @@ static struct option long_options[] = {
 	{"otip_period", 1, 0, '\200'},
 	{"otip_postactive", 1, 0, '\201'},
 	{"otip_preactive", 1, 0, '\202'},
+	{"max_stacks", 1, 0, '\203'},
+	{"intstack_shards", 1, 0, '\204'},
 	{"tcp_listen_backlog", 1, 0, '\210'},
 	{"tcp_timeout", 1, 0, '\211'},
 	{"udp_timeout", 1, 0, '\212'},
+	{"session_maxage", 1, 0, '\213'},
+	{"tcp_max_sessions", 1, 0, '\214'},
+	{"tcp_overload", 1, 0, '\215'},
+	{"tcp_queue_len", 1, 0, '\216'},
+	{"tcp_queue_timeout", 1, 0, '\217'},
+	{"stats", 1, 0, '\220'},
+	{"ratelimit_addr", 1, 0, '\221'},
+	{"ratelimit_net", 1, 0, '\222'},
+	{"io_uring", 0, 0, '\223'},
+	{"udp_busypoll", 1, 0, '\224'},
+	{"dns_responder", 1, 0, '\225'},
+	{"capture", 1, 0, '\226'},
+	{"cpus_main", 1, 0, '\227'},
+	{"cpus_relay", 1, 0, '\230'},
+	{"cpus_intstack", 1, 0, '\231'},
+	{"thread_stacksize", 1, 0, '\232'},
+	{"flowlog", 1, 0, '\233'},
 	{0,0,0,0}
 };
 
-static char *arg_tags = "dvpeinbPD\200\201\202\210\211\212";
+static char arg_tags[] = "dvpeinbPD\200\201\202\203\204\210\211\212\213\214\215\216\217\220\221\222\223\224\225\226\227\230\231\232\233";
 static union {
 	struct {
 		char *daemon;
@@ -146,11 +224,30 @@ static union {
 		char *passwd;
 		char *dns;
 		char *otip_period;
-		char *otip_preactive;
 		char *otip_postactive;
+		char *otip_preactive;
+		char *max_stacks;
+		char *intstack_shards;
 		char *tcp_listen_backlog;
 		char *tcp_timeout;
 		char *udp_timeout;
+		char *session_maxage;
+		char *tcp_max_sessions;
+		char *tcp_overload;
+		char *tcp_queue_len;
+		char *tcp_queue_timeout;
+		char *stats;
+		char *ratelimit_addr;
+		char *ratelimit_net;
+		char *io_uring;
+		char *udp_busypoll;
+		char *dns_responder;
+		char *capture;
+		char *cpus_main;
+		char *cpus_relay;
+		char *cpus_intstack;
+		char *thread_stacksize;
+		char *flowlog;
 	};
 	char *argv[sizeof(arg_tags)];
 } args;
@@ -211,13 +308,20 @@ struct proxyarg {
 	in_port_t extport;
 	char *intaddr_str;
 	in_port_t intport;
+	char *opts;
 };
 
 static int addproxy(int type, char *value, FILE *f) {
-	struct proxyarg arg = {.type = type, .intaddr_str = NULL};
+	struct proxyarg arg = {.type = type, .intaddr_str = NULL, .opts = NULL};
 	char intaddr_str[strlen(value) + 1];
-	int n = sscanf(value, "%hu,%[^,],%hu\n", &arg.extport, intaddr_str, &arg.intport);
+	int len = 0;
+	int n = sscanf(value, "%hu,%[^,],%hu%n", &arg.extport, intaddr_str, &arg.intport, &len);
 	if (n == 3 && arg.extport > 0 && arg.intport > 0) {
+		/* optional per-mapping options follow the internal port */
+		if (value[len] == ',')
+			arg.opts = strdup(value + len + 1);
+		else if (value[len] != '\0' && value[len] != '\n')
+			return -1;
 		arg.intaddr_str = strdup(intaddr_str);
 		if (fwrite(&arg, sizeof(arg), 1, f) == 1)
 			return 0;
@@ -236,6 +340,60 @@ int proxyarg(char *optname, char *value, void *arg) {
 	return -1;
 }
 
+/* tcp tuning profiles */
+static int tcp_profile(struct tcp_tuning *tuning, char *profile) {
+	if (profile == NULL)
+		return -1;
+	if (strcmp(profile, "interactive") == 0)
+		/* request/response services: low latency */
+		*tuning = (struct tcp_tuning) {.nodelay = 1, .fastopen = 16,
+			.keepidle = 60, .keepintvl = 10, .keepcnt = 6};
+	else if (strcmp(profile, "bulk") == 0)
+		/* bulk transfers: large windows */
+		*tuning = (struct tcp_tuning) {.rcvbuf = 4 << 20, .sndbuf = 4 << 20,
+			.keepidle = 60, .keepintvl = 10, .keepcnt = 6};
+	else
+		return -1;
+	return 0;
+}
+
+/* parse per-mapping options: tag=value list (stropt syntax) */
+static int parse_proxyopts(struct proxy_item *item, char *input) {
+	int tagc = stropt(input, NULL, NULL, NULL);
+	if(tagc > 0) {
+		char buf[strlen(input)+1];
+		char *tags[tagc];
+		char *args[tagc];
+		stropt(input, tags, args, buf);
+		for (int i=0; i < tagc - 1; i++) {
+			long value = args[i] ? strtol(args[i], NULL, 0) : 1;
+			switch(strcase(tags[i])) {
+				case STRCASE(m,a,x,c,o,n,n): item->maxconn = value; break;
+				case STRCASE(p,r,o,f,i,l,e):
+					if (tcp_profile(&item->tuning, args[i]) < 0) {
+						fprintf(stderr, "proxy option: unknown profile %s\n", args[i] ? args[i] : "");
+						return -1;
+					}
+					break;
+				case STRCASE(n,o,d,e,l,a,y): item->tuning.nodelay = value; break;
+				case STRCASE(f,a,s,t,o,p,e,n): item->tuning.fastopen = value; break;
+				case STRCASE(k,e,e,p,i,d,l,e): item->tuning.keepidle = value; break;
+				case STRCASE(k,e,e,p,i,n,t): item->tuning.keepintvl = value; break;
+				case STRCASE(k,e,e,p,c,n,t): item->tuning.keepcnt = value; break;
+				case STRCASE(r,c,v,b,u,f): item->tuning.rcvbuf = value; break;
+				case STRCASE(s,n,d,b,u,f): item->tuning.sndbuf = value; break;
+				case STRCASE(s,h,a,r,e,d): item->udp_shared = args[i] ? value : 16; break;
+				case STRCASE(g,r,o): item->udp_gro = value; break;
+				case STRCASE(w,e,i,g,h,t): item->sched.weight = value; break;
+				case STRCASE(r,a,t,e): item->sched.rate = value; break;
+				default: fprintf(stderr, "proxy option: unknown tag %s\n", tags[i]);
+					return -1;
+			}
+		}
+	}
+	return 0;
+}
+
 /* convert struct proxyarg entries to struct proxy_item entries
  * and split tcp to udp requests */
 struct proxy_item *proxyarg2proxy(int type, struct iothdns *intdns, struct proxyarg *arg, int *len) {
@@ -253,11 +411,16 @@ struct proxy_item *proxyarg2proxy(int type, struct iothdns *intdns, struct proxy
 				proxy[i].extport = arg->extport;
 				proxy[i].intsockaddr.sin6_family = AF_INET6;
 				proxy[i].intsockaddr.sin6_port = htons(arg->intport);
+				pthread_mutex_init(&proxy[i].sched.lock, NULL);
 				if (iothdns_lookup_aaaa_compat(intdns, arg->intaddr_str,
 							& proxy[i].intsockaddr.sin6_addr, 1) < 1) {
 					fprintf(stderr, "Error configuring proxy %s\n", arg->intaddr_str);
 					err = 1;
 				}
+				if (arg->opts && parse_proxyopts(&proxy[i], arg->opts) < 0) {
+					fprintf(stderr, "Error configuring proxy options %s\n", arg->opts);
+					err = 1;
+				}
 				i++;
 			}
 		}
@@ -269,6 +432,89 @@ struct proxy_item *proxyarg2proxy(int type, struct iothdns *intdns, struct proxy
 	return proxy;
 }
 
+/* free the strings of the proxyarg entries (up to the terminator) */
+static void proxyarg_free(struct proxyarg *arg) {
+	for (; arg->type != 0; arg++) {
+		free(arg->intaddr_str);
+		free(arg->opts);
+	}
+}
+
+/* proxy tables: tcp and udp proxy items of a configuration.
+ * The main loop uses the current tables for the new external stacks;
+ * each stack holds a reference to the tables it was created with, so
+ * after a reload the old tables (and the proxy_item structures used by
+ * live sessions) are freed when the last stack using them is closed */
+struct proxytabs {
+	_Atomic int refcount;
+	struct proxy_item *tcp;
+	struct proxy_item *udp;
+	int tcplen;
+	int udplen;
+};
+
+static void proxytab_free(struct proxy_item *tab, int len) {
+	if (tab != NULL) {
+		for (int i = 0; i < len; i++)
+			pthread_mutex_destroy(&tab[i].sched.lock);
+		free(tab);
+	}
+}
+
+/* the weights of the tcp mappings are relative (default 1):
+ * each step of nice value is a ratio of 1.25 in the CPU share */
+#define TCP_MAX_NICE 19
+static void tcp_weights(struct proxy_item *tab, int len) {
+	int maxweight = 1;
+	for (int i = 0; i < len; i++) {
+		if (tab[i].sched.weight <= 0)
+			tab[i].sched.weight = 1;
+		if (tab[i].sched.weight > maxweight)
+			maxweight = tab[i].sched.weight;
+	}
+	for (int i = 0; i < len; i++) {
+		double share = tab[i].sched.weight * 1.118; // sqrt(1.25): rounding
+		int nice = 0;
+		while (share < maxweight && nice < TCP_MAX_NICE) {
+			share *= 1.25;
+			nice++;
+		}
+		tab[i].sched.maxweight = maxweight;
+		tab[i].sched.nice = nice;
+	}
+}
+
+static struct proxytabs *proxytabs_new(struct iothdns *intdns, struct proxyarg *arg) {
+	struct proxytabs *tabs = calloc(1, sizeof(*tabs));
+	if (tabs == NULL)
+		return NULL;
+	tabs->refcount = 1;
+	tabs->tcp = proxyarg2proxy('t', intdns, arg, &tabs->tcplen);
+	tabs->udp = proxyarg2proxy('u', intdns, arg, &tabs->udplen);
+	/* proxyarg2proxy returns NULL in case of error */
+	if (tabs->tcp == NULL || tabs->udp == NULL) {
+		proxytab_free(tabs->tcp, tabs->tcplen);
+		proxytab_free(tabs->udp, tabs->udplen);
+		free(tabs);
+		return NULL;
+	}
+	tcp_weights(tabs->tcp, tabs->tcplen);
+	return tabs;
+}
+
+static void proxytabs_get(struct proxytabs *tabs) {
+	tabs->refcount++;
+}
+
+static void proxytabs_put(struct proxytabs *tabs) {
+	if (--tabs->refcount == 0) {
+		if (verbose) printlog(LOG_INFO, "free proxy tables %p", tabs);
+		proxytab_free(tabs->tcp, tabs->tcplen);
+		proxytab_free(tabs->udp, tabs->udplen);
+		free(tabs);
+	}
+}
+
 /* extstack definition uses a syntax similar to iothconf.
  * stack, vnl and iface have the same meaning as in iothconf */
 struct extargs {
@@ -299,12 +545,79 @@ struct extargs *parse_extargs(char *input) {
 		return NULL;
 }
 
+/* return 1 if the internal stack configuration sets a static address
+ * (ip=) or mac address (mac=, the autoconfigured address derives from it):
+ * shards created from the same configuration would share that address */
+static int intstack_static(char *input) {
+	int retval = 0;
+	int tagc = stropt(input, NULL, NULL, NULL);
+	if(tagc > 0) {
+		char buf[strlen(input)+1];
+		char *tags[tagc];
+		char *args[tagc];
+		stropt(input, tags, args, buf);
+		for (int i=0; i < tagc - 1; i++) {
+			switch(strcase(tags[i])) {
+				case STRCASE(i,p):
+				case STRCASE(m,a,c): retval = 1; break;
+			}
+		}
+	}
+	return retval;
+}
+
 /* count the threads currently using the extstack.
- * close the stack when usagecount is 0 */
+ * close the stack when usagecount is 0.
+ * alive stacks are kept in a list, oldest first: when there are more than
+ * conf_max_stacks alive stacks the oldest ones are marked as reaped,
+ * their listeners and sessions terminate so that the stacks can be freed */
 struct usagecount {
 	_Atomic int count;
+	_Atomic int reaped;
+	struct proxytabs *tabs;
+	struct usagecount *next;
 };
 
+static pthread_mutex_t stacklist_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct usagecount *stacklist;
+
+static void stacklist_add(struct usagecount *usage) {
+	struct usagecount **scan;
+	pthread_mutex_lock(&stacklist_mutex);
+	for (scan = &stacklist; *scan != NULL; scan = &((*scan)->next))
+		;
+	*scan = usage;
+	pthread_mutex_unlock(&stacklist_mutex);
+}
+
+static void stacklist_del(struct usagecount *usage) {
+	pthread_mutex_lock(&stacklist_mutex);
+	for (struct usagecount **scan = &stacklist; *scan != NULL; scan = &((*scan)->next)) {
+		if (*scan == usage) {
+			*scan = usage->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stacklist_mutex);
+}
+
+static void stacklist_reap(int max_stacks) {
+	int alive = 0;
+	pthread_mutex_lock(&stacklist_mutex);
+	for (struct usagecount *scan = stacklist; scan != NULL; scan = scan->next)
+		if (!scan->reaped)
+			alive++;
+	for (struct usagecount *scan = stacklist; scan != NULL && alive > max_stacks; scan = scan->next) {
+		if (!scan->reaped) {
+			if (verbose) printlog(LOG_INFO, "reap stack %p", scan);
+			scan->reaped = 1;
+			otip_stats.stacks_reaped++;
+			alive--;
+		}
+	}
+	pthread_mutex_unlock(&stacklist_mutex);
+}
+
 void extstack_usageup(struct connarg *conn) {
 	struct usagecount *usage = conn->extstack_usage;
 	if (verbose) printlog(LOG_INFO, "extstack_usageup %p", conn->extstack);
@@ -317,11 +630,157 @@ void extstack_usagedown(struct connarg *conn) {
 	int newcount = --usage->count;
 	if (newcount == 0) {
 		if (verbose) printlog(LOG_INFO, "close stack %p", conn->extstack);
+		stacklist_del(usage);
 		ioth_delstack(conn->extstack);
+		if (usage->tabs != NULL)
+			proxytabs_put(usage->tabs);
 		free(usage);
+		otip_stats.stacks_freed++;
 	}
 }
 
+int extstack_reaped(struct connarg *conn) {
+	return conn->extstack_usage->reaped;
+}
+
+/* internal stacks: sessions are spread among the instances by a hash of
+ * the client address and port and of the mapping port */
+static struct intstack *intstacks;
+static int nintstacks;
+
+struct intstack *intstack_get(const struct sockaddr_in6 *client, in_port_t extport) {
+	if (nintstacks == 1)
+		return intstacks;
+	const uint32_t *a = (const uint32_t *) &client->sin6_addr;
+	uint32_t h = 2166136261U;
+	uint32_t v[] = {a[0], a[1], a[2], a[3], client->sin6_port, extport};
+	for (unsigned int i = 0; i < sizeof(v) / sizeof(v[0]); i++)
+		h = (h ^ v[i]) * 16777619U;
+	h ^= h >> 16;
+	return &intstacks[h % nintstacks];
+}
+
+struct intstack *intstack_index(int index) {
+	return &intstacks[index % nintstacks];
+}
+
+static inline long elapsed_us(struct timespec *from) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) * 1000000L + (now.tv_nsec - from->tv_nsec) / 1000;
+}
+
+/* stack rotation cost: time to create, configure and start serving a new stack */
+static long rotation_last_us, rotation_max_us;
+
+static void printstats(void) {
+	struct procstat ps = {0, 0, 0};
+	long created = otip_stats.stacks_created;
+	long freed = otip_stats.stacks_freed;
+	procstat(&ps);
+	printlog(LOG_INFO, "stats: stacks %ld (created %ld freed %ld reaped %ld) "
+			"tcp %d (rejected %ld queued %ld wait %ldms throttled %ld) udp %d (reaped %ld pool full %ld gso %ld busypoll %ldus) ratelimited %ld dns %ld capture %ld (dropped %ld) "
+			"rss %ldkB fds %d threads %d rotation %ldus (max %ldus)",
+			created - freed, created, freed, otip_stats.stacks_reaped,
+			otip_stats.tcp_sessions, otip_stats.tcp_rejected,
+			otip_stats.tcp_queued, otip_stats.tcp_queue_wait_ms, otip_stats.tcp_throttled,
+			otip_stats.udp_flows, otip_stats.sessions_reaped, otip_stats.udp_pool_full, otip_stats.udp_gso,
+			otip_stats.udp_busypoll_us,
+			otip_stats.ratelimited, otip_stats.dns_queries,
+			otip_stats.capture_packets, otip_stats.capture_dropped,
+			ps.rss_kb, ps.fds, ps.threads,
+			rotation_last_us, rotation_max_us);
+	if (nintstacks > 1) {
+		for (int i = 0; i < nintstacks; i++)
+			printlog(LOG_INFO, "stats: intstack %d sessions %d (total %ld)", i,
+					intstacks[i].sessions, intstacks[i].total);
+	}
+}
+
+/* options that can be changed by a configuration reload */
+static struct {
+	char tag;
+	int *conf;
+	int dflt;
+} runtime_options[] = {
+	{'\211', &conf_tcp_timeout, 0},
+	{'\212', &conf_udp_timeout, 0},
+	{'\213', &conf_session_maxage, 0},
+	{'\217', &conf_tcp_queue_timeout, 0},
+	{'\224', &conf_udp_busypoll, 0},
+	{'\220', &conf_stats, 0},
+};
+#define RUNTIME_OPTIONS (sizeof(runtime_options) / sizeof(runtime_options[0]))
+
+static void set_runtime_options(void) {
+	static int init;
+	for (unsigned int i = 0; i < RUNTIME_OPTIONS; i++) {
+		char *arg = args.argv[argindex(runtime_options[i].tag)];
+		if (!init)
+			runtime_options[i].dflt = *runtime_options[i].conf;
+		*runtime_options[i].conf = arg ? strtol(arg, NULL, 0) : runtime_options[i].dflt;
+	}
+	init = 1;
+}
+
+/* configuration reload: the options set by the command line have priority
+ * (as at startup), the rc file is parsed again.
+ * The new proxy tables are used by the stacks created from now on */
+static char *cmdline_args[sizeof(arg_tags)];
+static char *cmdline_proxbuf;
+static size_t cmdline_proxlen;
+
+static struct proxytabs *reload_config(char *rcfile, struct iothdns *intdns) {
+	char *proxbuf = NULL;
+	size_t proxlen = 0;
+	for (unsigned int i = 0; i < sizeof(arg_tags); i++) {
+		/* free the values allocated by parse_rc_file */
+		if (args.argv[i] != NULL && args.argv[i] != cmdline_args[i] && *args.argv[i] != 0)
+			free(args.argv[i]);
+		args.argv[i] = cmdline_args[i];
+	}
+	FILE *prox = open_memstream(&proxbuf, &proxlen);
+	if (prox == NULL)
+		return NULL;
+	fwrite(cmdline_proxbuf, cmdline_proxlen, 1, prox);
+	int err = rcfile ? parse_rc_file(rcfile, long_options, proxyarg, prox) : 0;
+	fwrite(& (struct proxyarg) {.type = 0}, sizeof(struct proxyarg), 1, prox);
+	fclose(prox);
+	struct proxytabs *tabs = NULL;
+	if (err < 0)
+		printlog(LOG_ERR, "reload %s: %s", rcfile, strerror(errno));
+	else if ((tabs = proxytabs_new(intdns, (struct proxyarg *) proxbuf)) == NULL)
+		printlog(LOG_ERR, "reload: proxy configuration error");
+	else {
+		set_runtime_options();
+		printlog(LOG_INFO, "configuration reloaded: tcp %d udp %d", tabs->tcplen, tabs->udplen);
+	}
+	/* the strings of the command line entries are kept for the next reload */
+	proxyarg_free((struct proxyarg *) (proxbuf + cmdline_proxlen));
+	free(proxbuf);
+	return tabs;
+}
+
+/* parse a cpu list option: return 1 if set, 0 if not set, -1 in case of error.
+ * The set is restricted to the cpus this process can run on: a set with no
+ * usable cpu would make every thread creation fail */
+static int cpuset_arg(char *optname, char *arg, cpu_set_t *set) {
+	cpu_set_t allowed;
+	if (arg == NULL)
+		return 0;
+	if (parse_cpulist(arg, set) < 0) {
+		fprintf(stderr, "Error %s: invalid cpu list %s\n", optname, arg);
+		return -1;
+	}
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+		CPU_AND(set, set, &allowed);
+	if (CPU_COUNT(set) == 0) {
+		fprintf(stderr, "Error %s: no usable cpu in %s\n", optname, arg);
+		return -1;
+	}
+	return 1;
+}
+
 /* MAIN program */
 int main(int argc, char *argv[])
 {
@@ -363,6 +822,13 @@ int main(int argc, char *argv[])
 	if (argc == 1 || optind != argc || err)
 		usage(progname);
 
+	/* save the command line configuration for reloads */
+	memcpy(cmdline_args, args.argv, sizeof(cmdline_args));
+	fflush(prox);
+	if (proxlen > 0 && (cmdline_proxbuf = malloc(proxlen)) != NULL)
+		memcpy(cmdline_proxbuf, proxbuf, proxlen);
+	cmdline_proxlen = cmdline_proxbuf ? proxlen : 0;
+
 	if (rcfile) {
 		if (parse_rc_file(rcfile, long_options, proxyarg, prox) < 0) {
 			fprintf(stderr, "configfile %s: %s\n", rcfile, strerror(errno));
@@ -372,6 +838,12 @@ int main(int argc, char *argv[])
 
 	fwrite(& (struct proxyarg) {.type = 0}, sizeof(struct proxyarg), 1, prox);
 	fclose(prox);
+	/* reload: the daemon changes its working directory */
+	if (rcfile) rcfile = realpath(rcfile, NULL);
+
+	/* name and password cannot be changed by a reload */
+	char *otipname = args.name ? strdup(args.name) : NULL;
+	char *otippasswd = args.passwd ? strdup(args.passwd) : NULL;
 
 	ioth_set_license(SPDX_LICENSE);
 
@@ -390,14 +862,55 @@ int main(int argc, char *argv[])
 	if (extargs->iface == NULL)
 		extargs->iface = "vde0";
 
-	struct ioth *intstack = ioth_newstackc(args.intstack);
-	if (intstack == NULL) {
-		fprintf(stderr, "Error configuring internal stack %s\n", args.intstack);
+	/* thread placement. The threads of an ioth stack inherit the cpu set of
+	 * the thread creating the stack: the internal stacks are created while
+	 * the main thread runs on cpus_intstack, then the main thread (the epoch
+	 * scheduler, creating the external stacks) moves to cpus_main.
+	 * Listener and relay threads are created on cpus_relay */
+	cpu_set_t cpus_main, cpus_relay, cpus_intstack, cpus_saved;
+	int has_cpus_main = cpuset_arg("cpus_main", args.cpus_main, &cpus_main);
+	int has_cpus_relay = cpuset_arg("cpus_relay", args.cpus_relay, &cpus_relay);
+	int has_cpus_intstack = cpuset_arg("cpus_intstack", args.cpus_intstack, &cpus_intstack);
+	if (has_cpus_main < 0 || has_cpus_relay < 0 || has_cpus_intstack < 0)
 		exit(1);
+	spawn_thread_attr(args.thread_stacksize ? strtol(args.thread_stacksize, NULL, 0) : 0,
+			has_cpus_relay ? &cpus_relay : NULL);
+	pthread_getaffinity_np(pthread_self(), sizeof(cpus_saved), &cpus_saved);
+	if (has_cpus_intstack) {
+		int retval = pthread_setaffinity_np(pthread_self(), sizeof(cpus_intstack), &cpus_intstack);
+		if (retval != 0) {
+			fprintf(stderr, "Error cpus_intstack %s: %s\n", args.cpus_intstack, strerror(retval));
+			exit(1);
+		}
 	}
 
-	struct iothdns *intdns = iothdns_init_strcfg(intstack, args.dns); // XXX
-	if (intstack == NULL) {
+	nintstacks = args.intstack_shards ? strtol(args.intstack_shards, NULL, 0) : 1;
+	if (nintstacks < 1 || (intstacks = calloc(nintstacks, sizeof(*intstacks))) == NULL) {
+		fprintf(stderr, "Error configuring internal stack shards %s\n", args.intstack_shards);
+		exit(1);
+	}
+	if (nintstacks > 1 && args.intstack != NULL && intstack_static(args.intstack)) {
+		fprintf(stderr, "Error intstack_shards: all the shards would have the same address (%s)\n", args.intstack);
+		exit(1);
+	}
+	for (int i = 0; i < nintstacks; i++) {
+		intstacks[i].stack = ioth_newstackc(args.intstack);
+		if (intstacks[i].stack == NULL) {
+			fprintf(stderr, "Error configuring internal stack %s\n", args.intstack);
+			exit(1);
+		}
+	}
+	if (has_cpus_main) {
+		int retval = pthread_setaffinity_np(pthread_self(), sizeof(cpus_main), &cpus_main);
+		if (retval != 0) {
+			fprintf(stderr, "Error cpus_main %s: %s\n", args.cpus_main, strerror(retval));
+			exit(1);
+		}
+	} else if (has_cpus_intstack)
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus_saved), &cpus_saved);
+
+	struct iothdns *intdns = iothdns_init_strcfg(intstacks[0].stack, args.dns); // XXX
+	if (intdns == NULL) {
 		fprintf(stderr, "Error configuring internal dns %s\n", args.dns ? args.dns : "default");
 		exit(1);
 	}
@@ -414,14 +927,10 @@ int main(int argc, char *argv[])
 	}
 
 	/* set up the procy item tables for proxytcp and proxyudp */
-	struct proxy_item *proxytcptab, *proxyudptab;
-	int proxytcptablen, proxyudptablen;
-	proxytcptab = proxyarg2proxy('t', intdns, (struct proxyarg *) proxbuf, &proxytcptablen);
-	proxyudptab = proxyarg2proxy('u', intdns, (struct proxyarg *) proxbuf, &proxyudptablen);
+	struct proxytabs *proxytabs = proxytabs_new(intdns, (struct proxyarg *) proxbuf);
+	proxyarg_free((struct proxyarg *) (proxbuf + cmdline_proxlen));
 	free(proxbuf);
-
-	/* proxyarg2proxy returns NULL in case of error */
-	if (proxytcptab == NULL || proxyudptab == NULL)
+	if (proxytabs == NULL)
 		exit(1);
 
 	startlog(progname, args.daemon != NULL);
@@ -445,47 +954,138 @@ int main(int argc, char *argv[])
 	if (args.otip_period) conf_otip_period = strtol(args.otip_period, NULL, 0);
 	if (args.otip_preactive) conf_otip_preactive = strtol(args.otip_preactive, NULL, 0);
 	if (args.otip_postactive) conf_otip_postactive = strtol(args.otip_postactive, NULL, 0);
+	if (args.max_stacks) conf_max_stacks = strtol(args.max_stacks, NULL, 0);
 	conf_otip_lifetime = conf_otip_period + conf_otip_preactive + conf_otip_postactive;
+	/* do not reap stacks while their address is still valid */
+	int min_stacks = (conf_otip_lifetime + conf_otip_period - 1) / conf_otip_period;
+	if (conf_max_stacks > 0 && conf_max_stacks < min_stacks) {
+		printlog(LOG_WARNING, "max_stacks set to %d (otip lifetime/period)", min_stacks);
+		conf_max_stacks = min_stacks;
+	}
 	if (args.tcp_listen_backlog) conf_tcp_listen_backlog = strtol(args.tcp_listen_backlog, NULL, 0);
-	if (args.tcp_timeout) conf_tcp_timeout = strtol(args.tcp_timeout, NULL, 0);
-	if (args.udp_timeout) conf_udp_timeout = strtol(args.udp_timeout, NULL, 0);
+	set_runtime_options();
+	if (args.tcp_max_sessions) conf_tcp_max_sessions = strtol(args.tcp_max_sessions, NULL, 0);
+	if (args.tcp_overload) {
+		if (strcmp(args.tcp_overload, "queue") == 0)
+			conf_tcp_overload = TCP_OVERLOAD_QUEUE;
+		else if (strcmp(args.tcp_overload, "reject") == 0)
+			conf_tcp_overload = TCP_OVERLOAD_REJECT;
+		else {
+			printlog(LOG_ERR, "tcp_overload: unknown policy %s", args.tcp_overload);
+			exit(1);
+		}
+	}
+	if (args.tcp_queue_len) conf_tcp_queue_len = strtol(args.tcp_queue_len, NULL, 0);
+	if (args.io_uring) {
+#ifdef HAVE_LIBURING
+		conf_io_uring = 1;
+#else
+		printlog(LOG_WARNING, "io_uring support not available");
+#endif
+	}
+	if (args.ratelimit_addr && ratelimit_set(128, args.ratelimit_addr) < 0) {
+		printlog(LOG_ERR, "ratelimit_addr: invalid rate %s", args.ratelimit_addr);
+		exit(1);
+	}
+	if (args.ratelimit_net && ratelimit_set(64, args.ratelimit_net) < 0) {
+		printlog(LOG_ERR, "ratelimit_net: invalid rate %s", args.ratelimit_net);
+		exit(1);
+	}
+
+	if (args.capture && capture_set(args.capture, cwd) < 0)
+		exit(1);
+	if (args.flowlog && flowlog_set(args.flowlog, cwd) < 0)
+		exit(1);
+
+	/* the DNS responder needs a persistent stack (at a fixed address):
+	 * the external stacks change at each epoch.
+	 * It runs until exit: a reload (which rebuilds args) does not stop it */
+	int dns_responder = 0;
+	if (args.dns_responder) {
+		struct ioth *dnsstack = ioth_newstackc(args.dns_responder);
+		if (dnsstack == NULL || dnsresp_start(dnsstack, otipname) < 0) {
+			printlog(LOG_ERR, "dns_responder %s: %s", args.dns_responder, strerror(errno));
+			exit(1);
+		}
+		dns_responder = 1;
+	}
 
 	/* MAIN loop. Create new stacks when required */
 	uint32_t last_otiptime = 0;
+	uint32_t last_dnstime = 0;
+	time_t next_stats = time(NULL) + conf_stats;
   for(;;) {
+		if (reload_request) {
+			reload_request = 0;
+			struct proxytabs *newtabs = reload_config(rcfile, intdns);
+			if (newtabs != NULL) {
+				proxytabs_put(proxytabs);
+				proxytabs = newtabs;
+			}
+		}
     uint32_t otiptime = iothaddr_otiptime(conf_otip_period, conf_otip_preactive);
+		/* DNS answers follow the epochs as seen by clients (no preactive time):
+		 * encode the current and the next ones, the responder switches on time */
+		uint32_t dnstime = iothaddr_otiptime(conf_otip_period, 0);
+		if (dns_responder && dnstime != last_dnstime) {
+			for (uint32_t t = (last_dnstime + 1 == dnstime) ? dnstime + 1 : dnstime; t <= dnstime + 1; t++) {
+				struct in6_addr dnsaddr = baseaddr[0];
+				iothaddr_hash(&dnsaddr, otipname, otippasswd, t);
+				dnsresp_update(&dnsaddr, (time_t) t * conf_otip_period, (time_t) (t + 1) * conf_otip_period);
+			}
+			last_dnstime = dnstime;
+		}
     if (otiptime != last_otiptime) {
 			/* time to change stack */
       last_otiptime = otiptime;
 			if (verbose) printlog(LOG_INFO, "NEW stack %u", otiptime);
+			struct timespec rotation_start;
+			clock_gettime(CLOCK_MONOTONIC, &rotation_start);
 			struct connarg connarg;
 			connarg.extstack = ioth_newstack(extargs->stack, extargs->vnl);
 			if (connarg.extstack != NULL) {
-				connarg.intstack = intstack;
+				otip_stats.stacks_created++;
 				connarg.extstack_usage = calloc(1, sizeof(struct usagecount));
 				if (connarg.extstack_usage != NULL) {
 					extstack_usageup(&connarg);
+					stacklist_add(connarg.extstack_usage);
+					if (conf_max_stacks > 0)
+						stacklist_reap(conf_max_stacks);
 					int iface = ioth_if_nametoindex(connarg.extstack, extargs->iface);
 					struct in6_addr extaddr = baseaddr[0];
-					iothaddr_hash(&extaddr, args.name, args.passwd, otiptime);
+					iothaddr_hash(&extaddr, otipname, otippasswd, otiptime);
 					if (verbose) {
 						char ipasciibuf[INET6_ADDRSTRLEN];
-						printlog(LOG_INFO, "new stack addr %s %s", args.name,
+						printlog(LOG_INFO, "new stack addr %s %s", otipname,
 								inet_ntop(AF_INET6, &extaddr, ipasciibuf, sizeof(ipasciibuf)));
 					}
 					/* if these configuration instructions fail, simply the stack won't work */
 					ioth_ipaddr_add(connarg.extstack, AF_INET6, &extaddr, 64, iface);
 					ioth_linksetupdown(connarg.extstack, iface, 1);
 					ioth_linksetupdown(connarg.extstack, 1, 1);
-					connarg.item = proxytcptab;
-					connarg.size = proxytcptablen;
+					/* the stack keeps its tables until it is closed */
+					proxytabs_get(proxytabs);
+					connarg.extstack_usage->tabs = proxytabs;
+					connarg.epoch = otiptime;
+					connarg.item = proxytabs->tcp;
+					connarg.size = proxytabs->tcplen;
 					proxytcp(&connarg);
-					connarg.item = proxyudptab;
-					connarg.size = proxyudptablen;
+					connarg.item = proxytabs->udp;
+					connarg.size = proxytabs->udplen;
 					proxyudp(&connarg);
 					extstack_usagedown(&connarg);
+				} else {
+					ioth_delstack(connarg.extstack);
+					otip_stats.stacks_freed++;
 				}
 			}
+			rotation_last_us = elapsed_us(&rotation_start);
+			if (rotation_last_us > rotation_max_us)
+				rotation_max_us = rotation_last_us;
+		}
+		if (conf_stats > 0 && time(NULL) >= next_stats) {
+			printstats();
+			next_stats = time(NULL) + conf_stats;
 		}
 		sleep(1);
 	}
@@ -1,34 +1,110 @@
 #ifndef OTIP_RPROXY_H
 #define OTIP_RPROXY_H
 #include <netinet/in.h>
+#include <pthread.h>
 
 struct ioth;
 struct usagecount;
+/* tcp socket options, set by the tcp mapping options */
+struct tcp_tuning {
+	int nodelay;
+	int fastopen;
+	int keepidle;
+	int keepintvl;
+	int keepcnt;
+	int rcvbuf;
+	int sndbuf;
+};
+
+/* tcp bandwidth sharing: weight and aggregate rate limit of a mapping.
+ * maxweight is the highest weight of the tcp mappings, nice the scheduling
+ * priority of the relay threads derived from weight/maxweight */
+struct tcp_sched {
+	int weight;
+	int maxweight;
+	int nice;
+	long rate;
+	pthread_mutex_t lock;
+	long tokens;
+	long last_us;
+};
+
 struct proxy_item {
   in_port_t extport;
   struct sockaddr_in6 intsockaddr;
+  int maxconn;
+  _Atomic int sessions;
+  struct tcp_tuning tuning;
+  int udp_shared;
+  int udp_gro;
+  struct tcp_sched sched;
+};
+
+/* internal stack instances (shards) and their statistics */
+struct intstack {
+	struct ioth *stack;
+	_Atomic int sessions;
+	_Atomic long total;
 };
 
 struct connarg {
 	struct ioth *extstack;
-	struct ioth *intstack;
 	struct usagecount *extstack_usage;
 	struct proxy_item *item;
 	union {
 		int size;
 		int fd;
 	};
+	int queued;
+	struct sockaddr_in6 peer;
+	/* otip time of the external stack */
+	uint32_t epoch;
+};
+
+/* global counters, periodically logged (see --stats) */
+struct otip_stats {
+	_Atomic long stacks_created;
+	_Atomic long stacks_freed;
+	_Atomic long stacks_reaped;
+	_Atomic long sessions_reaped;
+	_Atomic long ratelimited;
+	_Atomic long udp_pool_full;
+	_Atomic long udp_gso;
+	_Atomic long udp_busypoll_us;
+	_Atomic int tcp_sessions;
+	_Atomic long tcp_rejected;
+	_Atomic long tcp_queued;
+	_Atomic long tcp_queue_wait_ms;
+	_Atomic long tcp_throttled;
+	_Atomic int udp_flows;
+	_Atomic long dns_queries;
+	_Atomic long capture_packets;
+	_Atomic long capture_dropped;
 };
+extern struct otip_stats otip_stats;
 
 extern int conf_otip_period;
 extern int conf_otip_lifetime;
 extern int conf_otip_preactive;
 extern int conf_tcp_listen_backlog;
 extern int conf_tcp_timeout;
+extern int conf_tcp_max_sessions;
+#define TCP_OVERLOAD_REJECT 0
+#define TCP_OVERLOAD_QUEUE 1
+extern int conf_tcp_overload;
+extern int conf_tcp_queue_len;
+extern int conf_tcp_queue_timeout;
+extern int conf_io_uring;
 extern int conf_udp_timeout;
+extern int conf_udp_busypoll;
+extern int conf_max_stacks;
+extern int conf_session_maxage;
 
+struct intstack *intstack_get(const struct sockaddr_in6 *client, in_port_t extport);
+struct intstack *intstack_index(int index);
 void extstack_usageup(struct connarg *connarg);
 void extstack_usagedown(struct connarg *connarg);
+int extstack_reaped(struct connarg *connarg);
 void proxytcp(struct connarg *connarg);
 void proxyudp(struct connarg *connarg);
 #endif
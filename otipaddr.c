@@ -27,6 +27,13 @@
 #include <libgen.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -47,20 +54,27 @@ static inline char *strchrnul(const char *s, int c) {
 void usage(char *progname, int isaddr)
 {
   fprintf(stderr,"Usage: %s OPTIONS name %s\n"
+      "       %s OPTIONS --batch|--server <path>\n"
       "\tOPTIONS:\n"
       "\t--base|--baseaddr|-b <IPv6 base address or base addr domain name>\n"
       "\t--dns|-D <dnsaddr>\n"
       "\t--dnsstack|-s <ioth_stack_conf>\n"
 			"%s"
+      "\t--batch|-B\n"
+      "\t--server|-S <unix socket path>\n"
+      "\t--binary|-x\n"
+      "\t--bench <count>\n"
       "\t--help|-h\n",
 			progname,
 			isaddr ? "" : "password",
+			progname,
 			isaddr ? "" : "\t--period|-T <otip_period>\n"
+			"\t--window|-w <from>,<to>\n"
       );
   exit(1);
 }
 
-static char *short_options = "hdvf:p:e:i:n:b:P:u:T:D:";
+static char *short_options = "hBxb:s:D:T:S:w:";
 static struct option long_options[] = {
   {"help", 0, 0, 'h'},
   {"base", 1, 0, 'b'},
@@ -68,16 +82,26 @@ static struct option long_options[] = {
   {"dnsstack", 1, 0, 's'},
   {"dns", 1, 0, 'D'},
   {"period", 1, 0, 'T'},
+  {"batch", 0, 0, 'B'},
+  {"server", 1, 0, 'S'},
+  {"window", 1, 0, 'w'},
+  {"binary", 0, 0, 'x'},
+  {"bench", 1, 0, '\200'},
   {0,0,0,0}
 };
 
-static char *arg_tags = "bsDT";
+static char arg_tags[] = "bsDTBSwx\200";
 static union {
   struct {
     char *baseaddr;
     char *dnsstack;
     char *dns;
     char *period;
+    char *batch;
+    char *server;
+    char *window;
+    char *binary;
+    char *bench;
   };
   char *argv[sizeof(arg_tags)];
 } args;
@@ -86,13 +110,248 @@ static inline int argindex(char tag) {
   return strchrnul(arg_tags, tag) - arg_tags;
 }
 
+static int otip_period = 32;
+
+/* base addresses resolved by DNS are cached: batch and server modes
+ * compute many addresses of the same domains */
+#define BASECACHE_SIZE 64
+#define BASECACHE_TTL 300
+static struct basecache {
+	char *domain;
+	struct in6_addr addr;
+	time_t expire;
+} basecache[BASECACHE_SIZE];
+static pthread_mutex_t basecache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t iothdns_once = PTHREAD_ONCE_INIT;
+static struct iothdns *iothdns;
+
+static void iothdns_start(void) {
+	ioth_set_license(SPDX_LICENSE);
+	struct ioth *dnsstack = ioth_newstackc(args.dnsstack);
+	iothdns = iothdns_init_strcfg(dnsstack, args.dns);
+}
+
+/* the mutex protects the cache only: queries for different domains
+ * (or served by other threads) do not wait for a slow DNS reply */
+static int lookup_base(const char *domain, struct in6_addr *baseaddr) {
+	time_t now = time(NULL);
+	pthread_mutex_lock(&basecache_mutex);
+	for (int i = 0; i < BASECACHE_SIZE; i++) {
+		struct basecache *entry = &basecache[i];
+		if (entry->domain != NULL && strcmp(entry->domain, domain) == 0 && now < entry->expire) {
+			*baseaddr = entry->addr;
+			pthread_mutex_unlock(&basecache_mutex);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&basecache_mutex);
+	pthread_once(&iothdns_once, iothdns_start);
+	if (iothdns == NULL || iothdns_lookup_aaaa(iothdns, domain, baseaddr, 1) != 1)
+		return -1;
+	char *newdomain = strdup(domain);
+	if (newdomain == NULL)
+		return 0;
+	pthread_mutex_lock(&basecache_mutex);
+	/* the victim is chosen now: the cache may have changed meanwhile */
+	struct basecache *victim = &basecache[0];
+	for (int i = 0; i < BASECACHE_SIZE; i++) {
+		struct basecache *entry = &basecache[i];
+		if (entry->domain != NULL && strcmp(entry->domain, domain) == 0) {
+			victim = entry;
+			break;
+		}
+		if (entry->expire < victim->expire)
+			victim = entry;
+	}
+	free(victim->domain);
+	victim->domain = newdomain;
+	victim->addr = *baseaddr;
+	victim->expire = now + BASECACHE_TTL;
+	pthread_mutex_unlock(&basecache_mutex);
+	return 0;
+}
+
+/* get the base address for name */
+static int otipaddr_base(char *name, struct in6_addr *addr) {
+	if (args.baseaddr != NULL && strchr(args.baseaddr, ':') != NULL) {
+		// numeric baseaddr
+		if (inet_pton(AF_INET6, args.baseaddr, addr) != 1) {
+			fprintf(stderr, "invalid base address: %s\n", args.baseaddr);
+			return -1;
+		}
+	} else {
+		char *domain = args.baseaddr;
+		if (domain == NULL) {
+			char *name2base = strchr(name, '.');
+			if (name2base == NULL) {
+				fprintf(stderr, "missing domain name: %s\n", name);
+				return -1;
+			}
+			domain = name2base + 1;
+		}
+		if (lookup_base(domain, addr) < 0) {
+			fprintf(stderr, "domain name base address not found: %s\n", domain);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* --window: range of epochs relative to the current one */
+static int window_set;
+static int window_from;
+static int window_to;
+static int binary;
+
+/* binary output record, integers in network byte order */
+struct otipaddr_record {
+	uint8_t addr[16];
+	uint64_t start;
+	uint64_t end;
+};
+
+static void otipaddr_output(FILE *out, struct in6_addr *addr, uint32_t otiptime) {
+	time_t start = (time_t) otiptime * otip_period;
+	time_t end = start + otip_period;
+	if (addr == NULL)
+		start = end = 0;
+	if (binary) {
+		struct otipaddr_record record = {
+			.start = htobe64(start),
+			.end = htobe64(end)
+		};
+		if (addr != NULL)
+			memcpy(record.addr, addr, sizeof(record.addr));
+		fwrite(&record, sizeof(record), 1, out);
+	} else if (addr == NULL)
+		fprintf(out, "-\n");
+	else {
+		char abuf[INET6_ADDRSTRLEN];
+		inet_ntop(AF_INET6, addr, abuf, INET6_ADDRSTRLEN);
+		if (window_set)
+			fprintf(out, "%s %ld %ld\n", abuf, (long) start, (long) end);
+		else
+			fprintf(out, "%s\n", abuf);
+	}
+}
+
+/* compute and print the addresses of name:
+ * otip addresses (for all the epochs of the window) if passwd != NULL,
+ * the hash address otherwise. The base address is resolved once */
+static int otipaddr(FILE *out, char *name, char *passwd) {
+	struct in6_addr base;
+	int from = (passwd != NULL) ? window_from : 0;
+	int count = (passwd != NULL) ? window_to - window_from + 1 : 1;
+	uint32_t otiptime = (passwd != NULL) ? iothaddr_otiptime(otip_period, 0) : 0;
+	if (name == NULL || otipaddr_base(name, &base) < 0) {
+		/* batch and server modes keep one output line (or record) per input line */
+		if (args.batch || args.server) {
+			for (int i = 0; i < count; i++)
+				otipaddr_output(out, NULL, 0);
+		}
+		return -1;
+	}
+	for (int i = 0; i < count; i++) {
+		struct in6_addr addr = base;
+		iothaddr_hash(&addr, name, passwd, otiptime + from + i);
+		otipaddr_output(out, &addr, otiptime + from + i);
+	}
+	return 0;
+}
+
+/* batch/server protocol: each input line is "name [password]",
+ * the output is the address (or the addresses of the window),
+ * "-" in case of error */
+static void otipaddr_stream(FILE *in, FILE *out, int isaddr) {
+	char *line = NULL;
+	size_t len;
+	while (getline(&line, &len, in) > 0) {
+		char name[len], passwd[len];
+		int n = sscanf(line, "%s %s", name, passwd);
+		otipaddr(out, n >= 1 ? name : NULL, (n == 2 && !isaddr) ? passwd : NULL);
+		fflush(out);
+	}
+	if (line) free(line);
+}
+
+/* micro-benchmark: hashes per second */
+static void otipaddr_bench(char *name, char *passwd, long count) {
+	struct in6_addr base, addr;
+	struct timespec start, end;
+	if (otipaddr_base(name, &base) < 0)
+		return;
+	uint32_t otiptime = iothaddr_otiptime(otip_period, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i = 0; i < count; i++) {
+		addr = base;
+		iothaddr_hash(&addr, name, passwd, otiptime + i);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%ld hashes in %.3f s: %.0f hashes/sec\n", count, elapsed, count / elapsed);
+}
+
+struct serverconn {
+	int fd;
+	int isaddr;
+};
+
+static void *otipaddr_serverconn(void *arg) {
+	struct serverconn *conn = arg;
+	FILE *in = fdopen(conn->fd, "r");
+	FILE *out = fdopen(dup(conn->fd), "w");
+	if (in != NULL && out != NULL)
+		otipaddr_stream(in, out, conn->isaddr);
+	if (in) fclose(in); else close(conn->fd);
+	if (out) fclose(out);
+	free(conn);
+	return NULL;
+}
+
+static int otipaddr_server(char *path, int isaddr) {
+	struct sockaddr_un sun = {.sun_family = AF_UNIX};
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "server socket %s: error\n", path);
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(fd, 16) < 0) {
+		fprintf(stderr, "server socket %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	for (;;) {
+		int cfd = accept(fd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		struct serverconn *conn = malloc(sizeof(*conn));
+		pthread_t p;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (conn == NULL)
+			close(cfd);
+		else {
+			*conn = (struct serverconn) {.fd = cfd, .isaddr = isaddr};
+			if (pthread_create(&p, &attr, otipaddr_serverconn, conn) != 0) {
+				close(cfd);
+				free(conn);
+			}
+		}
+		pthread_attr_destroy(&attr);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	char *progname = basename(argv[0]);
 	int isaddr = (strcmp(progname, "hashaddr") == 0);
 	int option_index;
 	char *name = NULL;
 	char *passwd = NULL;
-	struct in6_addr baseaddr;
 	while(1) {
 		int c;
 		if ((c = getopt_long (argc, argv, short_options,
@@ -110,40 +369,31 @@ int main(int argc, char *argv[]) {
 							 break;
 		}
 	}
+	if (args.period) otip_period = strtol(args.period, NULL, 0);
+	if (args.window) {
+		if (sscanf(args.window, "%d,%d", &window_from, &window_to) != 2 || window_from > window_to) {
+			fprintf(stderr, "invalid window: %s\n", args.window);
+			exit(1);
+		}
+		window_set = 1;
+	}
+	if (args.binary) binary = 1;
+	if (args.batch || args.server) {
+		if (argc != optind)
+			usage(progname, isaddr);
+		if (args.server)
+			return otipaddr_server(args.server, isaddr) < 0 ? 1 : 0;
+		otipaddr_stream(stdin, stdout, isaddr);
+		return 0;
+	}
 	if (isaddr ? argc != optind + 1 : argc != optind + 2)
 		usage(progname, isaddr);
 	name = argv[optind];
 	if (argc > optind + 1)
 		passwd = argv[optind + 1];
-	if (args.baseaddr != NULL && strchr(args.baseaddr, ':') != NULL) {
-		// numeric baseaddr
-		if (inet_pton(AF_INET6, args.baseaddr, &baseaddr) != 1) {
-			fprintf(stderr, "invalid base address: %s\n", args.baseaddr);
-			exit(1);
-		}
-	} else {
-		ioth_set_license(SPDX_LICENSE);
-		struct ioth *dnsstack = ioth_newstackc(args.dnsstack);
-		struct iothdns *iothdns = iothdns_init_strcfg(dnsstack, args.dns);
-		if (args.baseaddr == NULL) {
-			char *name2base = strchr(name, '.');
-			if (name2base == NULL) {
-				fprintf(stderr, "missing domain name: %s\n", name);
-				exit(1);
-			}
-			args.baseaddr = name2base + 1;
-		}
-		if (iothdns_lookup_aaaa(iothdns, args.baseaddr,  &baseaddr, 1) != 1) {
-				fprintf(stderr, "domain name base address not found: %s\n", args.baseaddr);
-				exit(1);
-		}
+	if (args.bench) {
+		otipaddr_bench(name, passwd, strtol(args.bench, NULL, 0));
+		return 0;
 	}
-	uint32_t otiptime = 0;
-	int otip_period = 32;
-	if (args.period) otip_period = strtol(args.period, NULL, 0);
-	if (passwd != NULL) otiptime = iothaddr_otiptime(otip_period, 0);
-	iothaddr_hash(&baseaddr, name, passwd, otiptime);
-	char abuf[INET6_ADDRSTRLEN];
-	printf("%s\n", inet_ntop(AF_INET6, &baseaddr, abuf, INET6_ADDRSTRLEN));
-	return 0;
+	return otipaddr(stdout, name, passwd) < 0 ? 1 : 0;
 }
@@ -0,0 +1,148 @@
+/*
+ *   otipflow.c: print the flow records of otip_rproxy
+ *
+ *   Copyright 2022 Renzo Davoli - Virtual Square Team
+ *   University of Bologna - Italy
+ *
+ * otipflow is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <flowlog.h>
+
+static const char *reasons[] = {"-", "idle", "maxage", "closed", "reaped", "noresource"};
+
+void usage(char *progname)
+{
+	fprintf(stderr,"Usage: %s OPTIONS flowlog_file\n"
+			"\tOPTIONS:\n"
+			"\t--follow|-f\n"
+			"\t--help|-h\n",
+			progname);
+	exit(1);
+}
+
+static char *short_options = "hf";
+static struct option long_options[] = {
+	{"help", 0, 0, 'h'},
+	{"follow", 0, 0, 'f'},
+	{0,0,0,0}
+};
+
+static void print_time(uint64_t ms) {
+	time_t t = ms / 1000;
+	struct tm tm;
+	char buf[32];
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", localtime_r(&t, &tm));
+	printf("%s.%03u", buf, (unsigned int) (ms % 1000));
+}
+
+/* print the record index, return 0 if it is not available
+ * (overwritten or being written) */
+static int print_record(struct flowrec *records, uint64_t nrecords, uint64_t index) {
+	struct flowrec *rec = &records[index % nrecords];
+	uint32_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+	struct flowrec copy;
+	memcpy(&copy, rec, sizeof(copy));
+	atomic_thread_fence(memory_order_acquire);
+	if (seq != (uint32_t) (index + 1) ||
+			atomic_load_explicit(&rec->seq, memory_order_relaxed) != seq)
+		return 0;
+	char client[INET6_ADDRSTRLEN], server[INET6_ADDRSTRLEN];
+	inet_ntop(AF_INET6, copy.client, client, sizeof(client));
+	inet_ntop(AF_INET6, copy.server, server, sizeof(server));
+	uint64_t start_ms = be64toh(copy.start_ms);
+	uint64_t end_ms = be64toh(copy.end_ms);
+	print_time(start_ms);
+	printf(" %llu.%03u %s [%s]:%u %u -> [%s]:%u epoch %u in %llu/%llu out %llu/%llu %s\n",
+			(unsigned long long) (end_ms - start_ms) / 1000, (unsigned int) ((end_ms - start_ms) % 1000),
+			copy.proto == IPPROTO_TCP ? "tcp" : "udp",
+			client, ntohs(copy.client_port), ntohs(copy.extport),
+			server, ntohs(copy.server_port), ntohl(copy.epoch),
+			(unsigned long long) be64toh(copy.bytes[0]), (unsigned long long) be64toh(copy.pkts[0]),
+			(unsigned long long) be64toh(copy.bytes[1]), (unsigned long long) be64toh(copy.pkts[1]),
+			copy.reason < sizeof(reasons) / sizeof(reasons[0]) ? reasons[copy.reason] : "-");
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	char *progname = basename(argv[0]);
+	int option_index;
+	int follow = 0;
+	while(1) {
+		int c;
+		if ((c = getopt_long (argc, argv, short_options,
+						long_options, &option_index)) < 0)
+			break;
+		switch (c) {
+			case 'f': follow = 1; break;
+			default: usage(progname); break;
+		}
+	}
+	if (argc != optind + 1)
+		usage(progname);
+	char *path = argv[optind];
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	struct flowlog_header *header = NULL;
+	if ((size_t) st.st_size >= sizeof(*header))
+		header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == NULL || header == MAP_FAILED ||
+			memcmp(header->magic, FLOWLOG_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != FLOWLOG_VERSION || header->recsize != sizeof(struct flowrec) ||
+			sizeof(*header) + header->nrecords * sizeof(struct flowrec) > (size_t) st.st_size) {
+		fprintf(stderr, "%s: not a flowlog file\n", path);
+		return 1;
+	}
+	struct flowrec *records = (struct flowrec *) (header + 1);
+	uint64_t nrecords = header->nrecords;
+	uint64_t next = atomic_load_explicit(&header->next, memory_order_acquire);
+	uint64_t index = next > nrecords ? next - nrecords : 0;
+	for (;;) {
+		for (; index < next; index++) {
+			/* records being written are printed at the next round */
+			if (!print_record(records, nrecords, index) && follow && next - index < nrecords)
+				break;
+		}
+		if (!follow)
+			break;
+		fflush(stdout);
+		sleep(1);
+		next = atomic_load_explicit(&header->next, memory_order_acquire);
+		/* skip the records overwritten in the meanwhile */
+		if (next - index > nrecords)
+			index = next - nrecords;
+	}
+	return 0;
+}
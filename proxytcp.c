@@ -21,45 +21,570 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <poll.h>
 #include <time.h>
+#include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include <ioth.h>
 #include <utils.h>
+#include <ratelimit.h>
 #include <otip_rproxy.h>
+#include <capture.h>
+#include <flowlog.h>
 
+/* relay buffers are allocated by the relay thread (not on its stack):
+ * the memory is local to the NUMA node the thread runs on, and small
+ * thread stacks can be used (see --thread_stacksize) */
 #define TCPBUFSIZE (128 * 1024)
 
+/* admission control: limit the number of concurrent tcp sessions,
+ * globally (conf_tcp_max_sessions) and per mapping (maxconn option).
+ * Connections exceeding the limits are rejected or wait in a bounded queue */
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t admission_cond = PTHREAD_COND_INITIALIZER;
+static int admitted;
+static int queued;
+
+/* admission_mutex must be locked */
+static int admission_try(struct proxy_item *item) {
+	if ((conf_tcp_max_sessions > 0 && admitted >= conf_tcp_max_sessions) ||
+			(item->maxconn > 0 && item->sessions >= item->maxconn))
+		return 0;
+	admitted++;
+	item->sessions++;
+	return 1;
+}
+
+static void admission_release(struct proxy_item *item) {
+	pthread_mutex_lock(&admission_mutex);
+	admitted--;
+	item->sessions--;
+	/* the waiters can be queued on different mappings: a single wakeup
+	 * could reach one still blocked by its maxconn */
+	pthread_cond_broadcast(&admission_cond);
+	pthread_mutex_unlock(&admission_mutex);
+}
+
+/* returns 1 if the connection is admitted or queued (*isqueued is set),
+ * 0 if it must be rejected */
+static int admission(struct proxy_item *item, int *isqueued) {
+	int retval = 1;
+	*isqueued = 0;
+	pthread_mutex_lock(&admission_mutex);
+	if (!admission_try(item)) {
+		if (conf_tcp_overload == TCP_OVERLOAD_QUEUE && queued < conf_tcp_queue_len) {
+			queued++;
+			*isqueued = 1;
+		} else
+			retval = 0;
+	}
+	pthread_mutex_unlock(&admission_mutex);
+	return retval;
+}
+
+/* queued connections wait (at most conf_tcp_queue_timeout secs) for a free slot */
+static int admission_wait(struct proxy_item *item) {
+	struct timespec start, deadline;
+	int retval;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline = start;
+	deadline.tv_sec += conf_tcp_queue_timeout;
+	pthread_mutex_lock(&admission_mutex);
+	while ((retval = admission_try(item)) == 0) {
+		if (pthread_cond_timedwait(&admission_cond, &admission_mutex, &deadline) == ETIMEDOUT) {
+			retval = admission_try(item);
+			break;
+		}
+	}
+	queued--;
+	pthread_mutex_unlock(&admission_mutex);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	otip_stats.tcp_queue_wait_ms += (now.tv_sec - start.tv_sec) * 1000 +
+		(now.tv_nsec - start.tv_nsec) / 1000000;
+	return retval;
+}
+
+static void admission_init(void) {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&admission_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* set the socket options of the mapping tuning profile */
+#define TUNE_LISTEN 1 /* external listening socket */
+#define TUNE_CONN   2 /* accepted external socket */
+#define TUNE_INT    4 /* internal socket */
+static int tcp_tune(int fd, struct tcp_tuning *tuning, int which) {
+	int retval = 0;
+	if (tuning->fastopen > 0 && (which & TUNE_LISTEN))
+		retval |= ioth_setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &tuning->fastopen, sizeof(int));
+	if (tuning->rcvbuf > 0 && (which & (TUNE_LISTEN | TUNE_INT)))
+		retval |= ioth_setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &tuning->rcvbuf, sizeof(int));
+	if (tuning->sndbuf > 0 && (which & (TUNE_LISTEN | TUNE_INT)))
+		retval |= ioth_setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &tuning->sndbuf, sizeof(int));
+	if (which & (TUNE_CONN | TUNE_INT)) {
+		if (tuning->nodelay > 0)
+			retval |= ioth_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &tuning->nodelay, sizeof(int));
+		if (tuning->keepidle > 0) {
+			int on = 1;
+			retval |= ioth_setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+			retval |= ioth_setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &tuning->keepidle, sizeof(int));
+			if (tuning->keepintvl > 0)
+				retval |= ioth_setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &tuning->keepintvl, sizeof(int));
+			if (tuning->keepcnt > 0)
+				retval |= ioth_setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &tuning->keepcnt, sizeof(int));
+		}
+	}
+	return retval;
+}
+
+/* check timeouts: idle time, reaped stack, max age.
+ * return the end reason if the session must be closed, 0 otherwise */
+static int tcpconn_expired(struct connarg *args, time_t start, time_t *idle_expire, int active) {
+	time_t now = time(NULL);
+	if (!active) {
+		if (now >= *idle_expire) return FLOW_END_IDLE;
+	} else
+		*idle_expire = now + conf_tcp_timeout;
+	if (extstack_reaped(args)) {
+		otip_stats.sessions_reaped++;
+		return FLOW_END_FORCED;
+	}
+	if (conf_session_maxage > 0 && now - start >= conf_session_maxage) {
+		otip_stats.sessions_reaped++;
+		return FLOW_END_ACTIVE;
+	}
+	return 0;
+}
+
+/* when stacks can be reaped or sessions have a max age, wake up
+	 once per second to check */
+static inline int tcpconn_tick(void) {
+	return (conf_max_stacks > 0 || conf_session_maxage > 0) ?
+		1000 : conf_tcp_timeout * 1000;
+}
+
+/* bandwidth sharing among sessions.
+ * Each session has a relay thread. The weights of the mappings are relative:
+ * the sessions of the mappings having the highest weight use the whole buffer
+ * at each turn of the relay loop and run at the normal priority, the others
+ * move a quantum of data proportional to weight/maxweight per turn and their
+ * threads have a higher nice value, so that the scheduler gives them a
+ * proportionally lower share of the cores when they are contended.
+ * A mapping can also have an aggregate rate limit (bytes/sec): a token
+ * bucket shared by all its sessions, sessions exceeding it sleep. */
+#define TCP_MIN_QUANTUM 4096
+
+static inline size_t tcp_quantum(struct proxy_item *item, size_t bufsize) {
+	size_t quantum = bufsize;
+	if (item->sched.maxweight > 0)
+		quantum = bufsize * item->sched.weight / item->sched.maxweight;
+	return quantum < TCP_MIN_QUANTUM ? TCP_MIN_QUANTUM : quantum;
+}
+
+static void tcp_throttle(struct proxy_item *item, size_t len) {
+	struct tcp_sched *sched = &item->sched;
+	struct timespec now;
+	long deficit;
+	if (sched->rate <= 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long now_us = now.tv_sec * 1000000L + now.tv_nsec / 1000;
+	long elapsed_us;
+	pthread_mutex_lock(&sched->lock);
+	/* refill, the max burst is one second of traffic: longer idle
+	 * times would overflow the product */
+	elapsed_us = now_us - sched->last_us;
+	if (elapsed_us > 1000000)
+		elapsed_us = 1000000;
+	sched->tokens += elapsed_us * sched->rate / 1000000;
+	if (sched->tokens > sched->rate || sched->last_us == 0)
+		sched->tokens = sched->rate;
+	sched->last_us = now_us;
+	sched->tokens -= len;
+	deficit = -sched->tokens;
+	pthread_mutex_unlock(&sched->lock);
+	if (deficit > 0) {
+		long delay_us = deficit * 1000000 / sched->rate;
+		otip_stats.tcp_throttled++;
+		nanosleep(&(struct timespec) {.tv_sec = delay_us / 1000000,
+				.tv_nsec = (delay_us % 1000000) * 1000}, NULL);
+	}
+}
+
+/* relay data: return the end reason */
+static int tcprelay_poll(struct connarg *args, int infd, struct flowstat *stat) {
+	struct pollfd pfd[] = {{args->fd, POLLIN, 0}, {infd, POLLIN, 0}};
+	int reason = FLOW_END_CLOSED;
+	uint8_t *buf = malloc(TCPBUFSIZE);
+	if (buf == NULL)
+		return FLOW_END_NORESOURCE;
+	size_t quantum = tcp_quantum(args->item, TCPBUFSIZE);
+	int tick = tcpconn_tick();
+	time_t start = time(NULL);
+	time_t idle_expire = start + conf_tcp_timeout;
+	struct capture_flow flow = {.proto = IPPROTO_TCP, .extport = args->item->extport,
+		.extfd = args->fd, .intfd = infd, .ext_peer = &args->peer, .int_peer = &args->item->intsockaddr};
+	for (;;) {
+		int pout = poll(pfd, 2, tick);
+		if (pout < 0 && errno == EINTR) continue;
+		if (pout < 0) break;
+		if ((reason = tcpconn_expired(args, start, &idle_expire, pout > 0)) != 0) break;
+		reason = FLOW_END_CLOSED;
+		if (pfd[0].revents & POLLIN) {
+			ssize_t n = ioth_recv(args->fd, buf, quantum, 0);
+			if (n <= 0) break;
+			capture(&flow, CAPTURE_EXT2INT, buf, n);
+			flowstat_add(stat, FLOW_EXT2INT, n, 1);
+			ioth_send(infd, buf, n, 0);
+			tcp_throttle(args->item, n);
+		}
+		if (pfd[1].revents & POLLIN) {
+			ssize_t n = ioth_recv(infd, buf, quantum, 0);
+			if (n <= 0) break;
+			capture(&flow, CAPTURE_INT2EXT, buf, n);
+			flowstat_add(stat, FLOW_INT2EXT, n, 1);
+			ioth_send(args->fd, buf, n, 0);
+			tcp_throttle(args->item, n);
+		}
+	}
+	free(buf);
+	return reason;
+}
+
+#ifdef HAVE_LIBURING
+/* true if fd is a kernel socket (kernel and vdestack stacks) */
+static int is_kernel_socket(int fd) {
+	int type;
+	socklen_t len = sizeof(type);
+	return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0;
+}
+
+/* io_uring relay: when both sockets are kernel sockets, recv and send
+ * operations for both directions are submitted and reaped in batches,
+ * one io_uring_enter per round instead of poll + recv + send.
+ * The length received is needed to send, so a send is queued when its
+ * recv completes, in the same submission of the other direction's ops. */
+#define URING_RECV 0
+#define URING_SEND 1
+#define URING_DATA(dir, op) (((dir) << 1) | (op))
+/* user data of the cancel requests */
+#define URING_CANCEL UINT64_MAX
+
+/* cancel the operations having the given user data and wait for their
+ * completion (the kernel may still write into their buffers).
+ * pending[i] is set if the operation having user data data[i] is in flight:
+ * a multishot operation ends with a completion without IORING_CQE_F_MORE.
+ * The results >= 0 of accept operations (fds) are closed.
+ * return -1 if the completions cannot be reaped */
+static int uring_cancel(struct io_uring *ring, int n, uint64_t *data, int *pending, int isaccept) {
+	int count = 0;
+	io_uring_submit(ring);
+	for (int i = 0; i < n; i++) {
+		if (pending[i]) {
+			struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+			if (sqe == NULL) {
+				io_uring_submit(ring);
+				sqe = io_uring_get_sqe(ring);
+			}
+			io_uring_prep_cancel64(sqe, data[i], 0);
+			io_uring_sqe_set_data64(sqe, URING_CANCEL);
+			count++;
+		}
+	}
+	io_uring_submit(ring);
+	while (count > 0) {
+		struct io_uring_cqe *cqe;
+		if (io_uring_wait_cqe(ring, &cqe) < 0)
+			return -1;
+		uint64_t cqedata = io_uring_cqe_get_data64(cqe);
+		if (cqedata != URING_CANCEL) {
+			if (isaccept && cqe->res >= 0)
+				close(cqe->res);
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				for (int i = 0; i < n; i++) {
+					if (pending[i] && data[i] == cqedata) {
+						pending[i] = 0;
+						count--;
+						break;
+					}
+				}
+			}
+		}
+		io_uring_cqe_seen(ring, cqe);
+	}
+	return 0;
+}
+
+static void uring_prep(struct io_uring *ring, int op, int dir, int fd, void *buf, size_t len) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	if (op == URING_RECV)
+		io_uring_prep_recv(sqe, fd, buf, len, 0);
+	else
+		io_uring_prep_send(sqe, fd, buf, len, MSG_NOSIGNAL);
+	io_uring_sqe_set_data64(sqe, URING_DATA(dir, op));
+}
+
+/* return the end reason,
+ * -1 if the ring cannot be created: use tcprelay_poll instead */
+static int tcprelay_uring(struct connarg *args, int infd, struct flowstat *stat) {
+	struct io_uring ring;
+	if (io_uring_queue_init(8, &ring, 0) < 0)
+		return -1;
+	int fd[2] = {args->fd, infd};
+	uint8_t (*buf)[TCPBUFSIZE / 2] = malloc(2 * sizeof(*buf));
+	if (buf == NULL) {
+		io_uring_queue_exit(&ring);
+		return -1;
+	}
+	size_t quantum = tcp_quantum(args->item, sizeof(buf[0]));
+	size_t len[2], off[2];
+	int tick = tcpconn_tick();
+	time_t start = time(NULL);
+	time_t idle_expire = start + conf_tcp_timeout;
+	struct capture_flow flow = {.proto = IPPROTO_TCP, .extport = args->item->extport,
+		.extfd = args->fd, .intfd = infd, .ext_peer = &args->peer, .int_peer = &args->item->intsockaddr};
+	/* the operation in flight of each direction */
+	uint64_t inflight[2];
+	int pending[2];
+	for (int dir = 0; dir < 2; dir++) {
+		uring_prep(&ring, URING_RECV, dir, fd[dir], buf[dir], quantum);
+		inflight[dir] = URING_DATA(dir, URING_RECV);
+		pending[dir] = 1;
+	}
+	int reason = FLOW_END_CLOSED;
+	for (int done = 0; !done; ) {
+		struct io_uring_cqe *cqe;
+		struct __kernel_timespec ts = {.tv_sec = tick / 1000, .tv_nsec = (tick % 1000) * 1000000};
+		int ret = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+		if (ret < 0 && ret != -ETIME && ret != -EINTR) break;
+		int active = 0;
+		while (!done && io_uring_peek_cqe(&ring, &cqe) == 0) {
+			uint64_t data = io_uring_cqe_get_data64(cqe);
+			int dir = data >> 1;
+			int res = cqe->res;
+			io_uring_cqe_seen(&ring, cqe);
+			pending[dir] = 0;
+			active = 1;
+			if (res <= 0) {
+				done = 1;
+				break;
+			}
+			if ((data & 1) == URING_RECV) {
+				/* dir 0 is ext -> int (CAPTURE_EXT2INT) */
+				capture(&flow, dir, buf[dir], res);
+				/* dir 0 is also FLOW_EXT2INT */
+				flowstat_add(stat, dir, res, 1);
+				len[dir] = res;
+				off[dir] = 0;
+			} else
+				off[dir] += res;
+			if (off[dir] < len[dir]) {
+				uring_prep(&ring, URING_SEND, dir, fd[1 - dir], buf[dir] + off[dir], len[dir] - off[dir]);
+				inflight[dir] = URING_DATA(dir, URING_SEND);
+			} else {
+				tcp_throttle(args->item, len[dir]);
+				uring_prep(&ring, URING_RECV, dir, fd[dir], buf[dir], quantum);
+				inflight[dir] = URING_DATA(dir, URING_RECV);
+			}
+			pending[dir] = 1;
+		}
+		if (!done)
+			done = reason = tcpconn_expired(args, start, &idle_expire, active);
+		if (!done)
+			reason = FLOW_END_CLOSED;
+	}
+	/* the buffers can be freed only when no operation is in flight */
+	if (uring_cancel(&ring, 2, inflight, pending, 0) < 0)
+		printlog(LOG_ERR, "io_uring relay: cannot reap the pending operations");
+	else
+		free(buf);
+	io_uring_queue_exit(&ring);
+	return reason;
+}
+#endif
+
 /* tcpconn manages a tcp connection. there is a tcpconn thread for each active TCP connection */
 static void *tcpconn(void *arg) {
 	struct connarg *args = arg;
-	int infd = ioth_msocket(args->intstack, AF_INET6, SOCK_STREAM, 0);
+	struct flowstat stat = {{0, 0}, {0, 0}};
+	uint64_t start_ms = flowlog_now_ms();
+	if (args->queued && admission_wait(args->item) == 0) {
+		otip_stats.tcp_rejected++;
+		flowlog_record(IPPROTO_TCP, args->item, &args->peer, args->epoch, start_ms, &stat, FLOW_END_NORESOURCE);
+		ioth_close(args->fd);
+		extstack_usagedown(args);
+		free(args);
+		return NULL;
+	}
+	otip_stats.tcp_sessions++;
+	/* per thread priority (the thread terminates with the session) */
+	if (args->item->sched.nice > 0)
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), args->item->sched.nice);
+	struct intstack *intstack = intstack_get(&args->peer, args->item->extport);
+	intstack->sessions++;
+	intstack->total++;
+	int infd = ioth_msocket(intstack->stack, AF_INET6, SOCK_STREAM, 0);
+	/* errors are not fatal: stacks may not support some options */
+	tcp_tune(args->fd, &args->item->tuning, TUNE_CONN);
+	tcp_tune(infd, &args->item->tuning, TUNE_INT);
+	int reason = FLOW_END_NORESOURCE;
 	if (ioth_connect(infd, (struct sockaddr *)&args->item->intsockaddr, sizeof(struct sockaddr_in6)) >= 0) {
-		struct pollfd pfd[] = {{args->fd, POLLIN, 0}, {infd, POLLIN, 0}};
-    uint8_t buf[TCPBUFSIZE];
-    for (;;) {
-			int pout = poll(pfd, 2, conf_tcp_timeout * 1000);
-      if (pout <= 0) break;
-      if (pfd[0].revents & POLLIN) {
-        ssize_t n = ioth_recv(args->fd, buf, TCPBUFSIZE, 0);
-        if (n <= 0) break;
-        ioth_send(infd, buf, n, 0);
-      }
-      if (pfd[1].revents & POLLIN) {
-        ssize_t n = ioth_recv(infd, buf, TCPBUFSIZE, 0);
-        if (n <= 0) break;
-        ioth_send(args->fd, buf, n, 0);
-      }
-		}
+#ifdef HAVE_LIBURING
+		if (!conf_io_uring || !is_kernel_socket(args->fd) || !is_kernel_socket(infd) ||
+				(reason = tcprelay_uring(args, infd, &stat)) < 0)
+#endif
+			reason = tcprelay_poll(args, infd, &stat);
 	}
+	flowlog_record(IPPROTO_TCP, args->item, &args->peer, args->epoch, start_ms, &stat, reason);
 	ioth_close(infd);
 	ioth_close(args->fd);
+	otip_stats.tcp_sessions--;
+	intstack->sessions--;
+	admission_release(args->item);
 	extstack_usagedown(args);
 	free(args);
 	return NULL;
 }
 
+/* a new connection has been accepted on the i-th port:
+ * rate limit, admission control, then start its tcpconn thread */
+static void tcpaccept(struct connarg *args, int i, int afd, struct sockaddr_in6 *peer) {
+	if (!ratelimit_check(&peer->sin6_addr)) {
+		otip_stats.ratelimited++;
+		ioth_close(afd);
+		return;
+	}
+	int isqueued;
+	if (admission(&args->item[i], &isqueued) == 0) {
+		otip_stats.tcp_rejected++;
+		ioth_close(afd);
+		return;
+	}
+	if (isqueued)
+		otip_stats.tcp_queued++;
+	struct connarg *tcpconnargs = malloc(sizeof(struct connarg));
+	if (tcpconnargs) {
+		*tcpconnargs = *args;
+		tcpconnargs->item = &args->item[i];
+		tcpconnargs->fd = afd;
+		tcpconnargs->queued = isqueued;
+		tcpconnargs->peer = *peer;
+		extstack_usageup(args);
+		if (spawn_thread(tcpconn, tcpconnargs) == 0)
+			return;
+		printlog(LOG_ERR, "cannot create tcp connection thread port %d", args->item[i].extport);
+		free(tcpconnargs);
+		extstack_usagedown(args);
+	}
+	/* undo admission */
+	otip_stats.tcp_rejected++;
+	ioth_close(afd);
+	if (isqueued) {
+		pthread_mutex_lock(&admission_mutex);
+		queued--;
+		pthread_mutex_unlock(&admission_mutex);
+	} else
+		admission_release(&args->item[i]);
+}
+
+/* wait for the next accept: return the timeout in ms, -1 if the listener must terminate */
+static int tcplisten_timeout(struct connarg *args, time_t expire) {
+	time_t now = time(NULL);
+	if (now >= expire || extstack_reaped(args)) return -1;
+	int timeout = (expire - now) * 1000;
+	/* check once per second if the stack has been reaped */
+	if (conf_max_stacks > 0 && timeout > 1000) timeout = 1000;
+	return timeout;
+}
+
+static void tcplisten_poll(struct connarg *args, struct pollfd *pfd, time_t expire) {
+	int timeout;
+	while ((timeout = tcplisten_timeout(args, expire)) >= 0) {
+		int pout = poll(pfd, args->size, timeout);
+		if (pout < 0 && errno == EINTR) continue;
+		if (pout < 0) break;
+		for (int i = 0; i < args->size; i++) {
+			if (pfd[i].revents & POLLIN) {
+				struct sockaddr_in6 peer;
+				socklen_t peerlen = sizeof(peer);
+				int afd = ioth_accept(pfd[i].fd, (struct sockaddr *) &peer, &peerlen);
+				if (afd >= 0)
+					tcpaccept(args, i, afd, &peer);
+			}
+		}
+	}
+}
+
+#ifdef HAVE_LIBURING
+/* io_uring listener: a multishot accept for each port.
+ * return -1 if io_uring cannot be used: use tcplisten_poll instead */
+static int tcplisten_uring(struct connarg *args, struct pollfd *pfd, time_t expire) {
+	struct io_uring ring;
+	int timeout;
+	if (!conf_io_uring || args->size == 0)
+		return -1;
+	for (int i = 0; i < args->size; i++)
+		if (!is_kernel_socket(pfd[i].fd))
+			return -1;
+	if (io_uring_queue_init(args->size, &ring, 0) < 0)
+		return -1;
+	/* armed[i]: the multishot accept of port i is active */
+	uint64_t portdata[args->size];
+	int armed[args->size];
+	for (int i = 0; i < args->size; i++) {
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_multishot_accept(sqe, pfd[i].fd, NULL, NULL, 0);
+		io_uring_sqe_set_data64(sqe, i);
+		portdata[i] = i;
+		armed[i] = 1;
+	}
+	while ((timeout = tcplisten_timeout(args, expire)) >= 0) {
+		struct io_uring_cqe *cqe;
+		struct __kernel_timespec ts = {.tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000};
+		int ret = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+		if (ret < 0 && ret != -ETIME && ret != -EINTR) break;
+		while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+			int i = io_uring_cqe_get_data64(cqe);
+			int afd = cqe->res;
+			int more = cqe->flags & IORING_CQE_F_MORE;
+			io_uring_cqe_seen(&ring, cqe);
+			if (afd >= 0) {
+				struct sockaddr_in6 peer = {.sin6_family = AF_INET6};
+				socklen_t peerlen = sizeof(peer);
+				getpeername(afd, (struct sockaddr *) &peer, &peerlen);
+				tcpaccept(args, i, afd, &peer);
+			}
+			if (!more) {
+				/* the kernel terminated the multishot accept: rearm */
+				struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+				armed[i] = (sqe != NULL);
+				if (sqe != NULL) {
+					io_uring_prep_multishot_accept(sqe, pfd[i].fd, NULL, NULL, 0);
+					io_uring_sqe_set_data64(sqe, i);
+				}
+			}
+		}
+	}
+	/* the connections accepted but not reaped yet are closed */
+	uring_cancel(&ring, args->size, portdata, armed, 1);
+	io_uring_queue_exit(&ring);
+	return 0;
+}
+#endif
+
 /* listen thread. It waits for TCP connects on all the proxy ports */
 static void *tcplisten(void * arg) {
 	struct connarg *args = arg;
@@ -73,33 +598,18 @@ static void *tcplisten(void * arg) {
 		extsock.sin6_port = htons(args->item[i].extport);
 		if (ioth_bind(pfd[i].fd, (struct sockaddr *)&extsock, sizeof(extsock)) < 0)
 			printlog(LOG_ERR, "bind error tcp port %d", args->item[i].extport);
+		if (tcp_tune(pfd[i].fd, &args->item[i].tuning, TUNE_LISTEN) < 0)
+			printlog(LOG_ERR, "setsockopt error tcp port %d", args->item[i].extport);
 		if (ioth_listen(pfd[i].fd, conf_tcp_listen_backlog) < 0)
 			printlog(LOG_ERR, "listen error tcp port %d", args->item[i].extport);
 		pfd[i].events = POLLIN;
 		pfd[i].revents = 0;
 	}
-	int timeout = (conf_otip_lifetime + 1) * 1000;
 	time_t expire = time(NULL) + conf_otip_lifetime;
-	for (;;) {
-		int pout = poll(pfd, args->size, timeout);
-		if (pout <= 0) break;
-		for (int i = 0; i < args->size; i++) {
-			if (pfd[i].revents & POLLIN) {
-				int afd = ioth_accept(pfd[i].fd, NULL, 0);
-				struct connarg *tcpconnargs = malloc(sizeof(struct connarg));
-				if (tcpconnargs) {
-					*tcpconnargs = *args;
-					tcpconnargs->item = &args->item[i];
-					tcpconnargs->fd = afd;
-					pthread_t p;
-					extstack_usageup(args);
-					if (pthread_create(&p, NULL, tcpconn, (void *) tcpconnargs) < 0)
-						extstack_usagedown(args);
-				}
-			}
-		}
-		timeout = (expire - time(NULL) + 1) * 1000;
-	}
+#ifdef HAVE_LIBURING
+	if (tcplisten_uring(args, pfd, expire) < 0)
+#endif
+		tcplisten_poll(args, pfd, expire);
 	for (int i = 0; i < args->size; i++)
 		ioth_close(pfd[i].fd);
 	extstack_usagedown(args);
@@ -108,11 +618,18 @@ static void *tcplisten(void * arg) {
 }
 
 void proxytcp(struct connarg *connarg) {
+	static pthread_once_t admission_once = PTHREAD_ONCE_INIT;
+	pthread_once(&admission_once, admission_init);
 	struct connarg *tcpconn = malloc(sizeof(struct connarg));
+	if (tcpconn == NULL)
+		return;
 	*tcpconn = *connarg;
-	pthread_t p;
 	extstack_usageup(tcpconn);
-	if (pthread_create(&p, NULL, tcplisten, (void *) tcpconn) < 0)
+	int retval = spawn_thread(tcplisten, tcpconn);
+	if (retval != 0) {
+		printlog(LOG_ERR, "cannot create tcp listener thread: %s", strerror(retval));
 		extstack_usagedown(tcpconn);
+		free(tcpconn);
+	}
 	return;
 }
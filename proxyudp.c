@@ -21,32 +21,237 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
-#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <sys/epoll.h>
 
 #include <ioth.h>
 #include <utils.h>
+#include <ratelimit.h>
 #include <otip_rproxy.h>
+#include <capture.h>
+#include <flowlog.h>
 
 #define UDPBUFSIZE (64 * 1024)
 #define NEVENTS 5
 
 #define CMSG_PKTINFO_SIZE CMSG_SPACE(sizeof(struct in6_pktinfo))
+#define CMSG_GRO_SIZE CMSG_SPACE(sizeof(int))
+#define CMSG_GSO_SIZE CMSG_SPACE(sizeof(uint16_t))
 
 struct udpconn {
 	int fd;
 	int i;
+	int shared;
+	int busy;
+	struct intstack *intstack;
+	time_t start;
 	time_t expire;
+	uint64_t start_ms;
 	struct udpconn *next;
 	struct sockaddr_in6 sender;
+	struct flowstat stat;
 	size_t ctllen;
 	uint8_t ctlbuf[];
 };
 
 static int on = 1;
 
+static inline long monotonic_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* split the ancillary data received: copy IPV6_PKTINFO (which identifies the
+ * flow and is used to reply from the same address) to ctlbuf, return its length.
+ * *segsize is the segment size of datagrams coalesced by UDP_GRO, 0 otherwise */
+static size_t udp_cmsg(struct msghdr *hdr, uint8_t *ctlbuf, int *segsize) {
+	size_t ctllen = 0;
+	*segsize = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO && ctllen == 0) {
+			ctllen = CMSG_PKTINFO_SIZE;
+			memset(ctlbuf, 0, ctllen);
+			memcpy(ctlbuf, cmsg, cmsg->cmsg_len);
+		} else if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+			memcpy(segsize, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return ctllen;
+}
+
+/* send a datagram. If segsize > 0, buf contains segments of segsize bytes
+ * coalesced by UDP_GRO (the last one can be shorter): send them at once using
+ * UDP_SEGMENT (GSO). If the stack does not support it, clear *gso and
+ * send one datagram per segment. */
+static void udp_send(int fd, struct sockaddr_in6 *to, uint8_t *ctlbuf, size_t ctllen,
+		uint8_t *buf, size_t len, int segsize, int *gso) {
+	struct iovec iov = {.iov_base = buf, .iov_len = len};
+	struct msghdr hdr = {
+		.msg_name = to,
+		.msg_namelen = to ? sizeof(struct sockaddr_in6) : 0,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctllen ? ctlbuf : NULL,
+		.msg_controllen = ctllen
+	};
+	if (segsize <= 0 || (size_t) segsize >= len) {
+		sendmsg(fd, &hdr, 0);
+		return;
+	}
+	if (*gso) {
+		uint8_t gsobuf[CMSG_PKTINFO_SIZE + CMSG_GSO_SIZE] = {0};
+		memcpy(gsobuf, ctlbuf, ctllen);
+		struct cmsghdr *cmsg = (struct cmsghdr *) (gsobuf + ctllen);
+		uint16_t gso_size = segsize;
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+		hdr.msg_control = gsobuf;
+		hdr.msg_controllen = ctllen + CMSG_GSO_SIZE;
+		if (sendmsg(fd, &hdr, 0) >= 0) {
+			otip_stats.udp_gso++;
+			return;
+		}
+		if (errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP || errno == EIO)
+			*gso = 0;
+		hdr.msg_control = ctllen ? ctlbuf : NULL;
+		hdr.msg_controllen = ctllen;
+	}
+	for (size_t off = 0; off < len; off += segsize) {
+		iov.iov_base = buf + off;
+		iov.iov_len = (len - off < (size_t) segsize) ? len - off : (size_t) segsize;
+		sendmsg(fd, &hdr, 0);
+	}
+}
+
+/* number of datagrams in a buffer (coalesced by UDP_GRO if segsize > 0) */
+static inline size_t udp_segments(size_t len, int segsize) {
+	return segsize > 0 ? (len + segsize - 1) / segsize : 1;
+}
+
+static void udp_flowlog(struct connarg *args, struct udpconn *conn, int reason) {
+	flowlog_record(IPPROTO_UDP, &args->item[conn->i], &conn->sender, args->epoch,
+			conn->start_ms, &conn->stat, reason);
+}
+
+/* capture a datagram of conn (the external local address is in IPV6_PKTINFO) */
+static void udp_capture(int extfd, struct udpconn *conn, struct proxy_item *item, int dir,
+		uint8_t *buf, size_t len) {
+	struct in6_pktinfo *pktinfo = conn->ctllen > 0 ?
+		(struct in6_pktinfo *) CMSG_DATA((struct cmsghdr *) conn->ctlbuf) : NULL;
+	struct capture_flow flow = {.proto = IPPROTO_UDP, .extport = item->extport,
+		.extfd = extfd, .intfd = conn->fd, .ext_peer = &conn->sender, .int_peer = &item->intsockaddr,
+		.ext_local = pktinfo ? &pktinfo->ipi6_addr : NULL};
+	capture_packet(&flow, dir, buf, len);
+}
+
+/* shared mode (for stateless request/response services):
+ * a fixed pool of internal sockets for each mapping, created once per stack.
+ * Each socket (i.e. its internal source port) serves a request at a time: the
+ * first reply is forwarded to the client which sent the request, then the socket
+ * returns to the free list. No socket is created or closed per flow.
+ * The free list is a FIFO queue: a socket is reused as late as possible, so
+ * a duplicate reply is unlikely to reach the client of the next request.
+ * A socket whose request timed out is replaced by a new one (a new source
+ * port): a late reply cannot be forwarded to another client. */
+struct udppool {
+	int size;
+	int busy;
+	struct udpconn *free;
+	struct udpconn **tail;
+	struct udpconn *conn[];
+};
+
+static int udppool_socket(int epfd, struct proxy_item *item, struct udpconn *conn) {
+	conn->fd = ioth_msocket(conn->intstack->stack, AF_INET6, SOCK_DGRAM, 0);
+	if (conn->fd < 0 ||
+			ioth_connect(conn->fd, (struct sockaddr *) &item->intsockaddr, sizeof(struct sockaddr_in6)) < 0 ||
+			epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd,
+				&(struct epoll_event) {.events = EPOLLIN, .data.ptr = conn}) < 0) {
+		printlog(LOG_ERR, "shared socket error udp port %d", item->extport);
+		ioth_close(conn->fd);
+		conn->fd = -1;
+		return -1;
+	}
+	if (item->udp_gro)
+		ioth_setsockopt(conn->fd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+	if (conf_udp_busypoll > 0)
+		ioth_setsockopt(conn->fd, SOL_SOCKET, SO_BUSY_POLL, &conf_udp_busypoll, sizeof(int));
+	return 0;
+}
+
+static void udppool_put(struct udppool *pool, struct udpconn *conn) {
+	conn->next = NULL;
+	*pool->tail = conn;
+	pool->tail = &conn->next;
+}
+
+static struct udpconn *udppool_get(struct udppool *pool) {
+	struct udpconn *conn = pool->free;
+	if (conn != NULL) {
+		pool->free = conn->next;
+		if (pool->free == NULL)
+			pool->tail = &pool->free;
+	}
+	return conn;
+}
+
+static struct udppool *udppool_new(int epfd, struct proxy_item *item, int i) {
+	struct udppool *pool = calloc(1, sizeof(*pool) + item->udp_shared * sizeof(struct udpconn *));
+	if (pool == NULL)
+		return NULL;
+	pool->tail = &pool->free;
+	for (int k = 0; k < item->udp_shared; k++) {
+		struct udpconn *conn = calloc(1, sizeof(*conn) + CMSG_PKTINFO_SIZE);
+		if (conn == NULL)
+			break;
+		conn->intstack = intstack_index(k);
+		if (udppool_socket(epfd, item, conn) < 0) {
+			free(conn);
+			break;
+		}
+		conn->i = i;
+		conn->shared = 1;
+		udppool_put(pool, conn);
+		pool->conn[pool->size++] = conn;
+	}
+	return pool;
+}
+
+static void udppool_free(int epfd, struct udppool *pool) {
+	for (int k = 0; k < pool->size; k++) {
+		if (pool->conn[k]->fd >= 0) {
+			epoll_ctl(epfd, EPOLL_CTL_DEL, pool->conn[k]->fd, NULL);
+			ioth_close(pool->conn[k]->fd);
+		}
+		free(pool->conn[k]);
+	}
+	free(pool);
+}
+
+static void udppool_release(struct udppool *pool, struct udpconn *conn) {
+	conn->busy = 0;
+	if (conn->fd >= 0)
+		udppool_put(pool, conn);
+	pool->busy--;
+	otip_stats.udp_flows--;
+	conn->intstack->sessions--;
+}
+
+/* the request got no reply: change the source port of the socket */
+static void udppool_renew(int epfd, struct proxy_item *item, struct udpconn *conn) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	ioth_close(conn->fd);
+	/* on error the socket leaves the pool (fd == -1) */
+	udppool_socket(epfd, item, conn);
+}
+
 static void *udplisten(void * arg) {
 	struct connarg *args = arg;
 	struct sockaddr_in6 extsock = {
@@ -57,9 +262,21 @@ static void *udplisten(void * arg) {
 	time_t now = time(NULL);
 	time_t last = now;
 	time_t expire = now + conf_otip_lifetime;
+	/* one relay buffer per thread, allocated by the thread itself (NUMA local) */
+	uint8_t *buf = malloc(UDPBUFSIZE);
+	if (buf == NULL) {
+		printlog(LOG_ERR, "udp relay: %s", strerror(errno));
+		extstack_usagedown(args);
+		free(args);
+		return NULL;
+	}
 	int epfd = epoll_create(1);
 	int fd[args->size];
 	struct udpconn *fdconn[args->size];
+	struct udppool *pool[args->size];
+	/* GSO status (1 = supported, or not tried yet) on the external and internal side */
+	int gso_ext[args->size];
+	int gso_int[args->size];
 	for (int i = 0; i < args->size; i++) {
 		fd[i] = ioth_msocket(args->extstack, AF_INET6, SOCK_DGRAM, 0);
 		extsock.sin6_port = htons(args->item[i].extport);
@@ -67,14 +284,40 @@ static void *udplisten(void * arg) {
 			printlog(LOG_ERR, "bind error udp port %d", args->item[i].extport);
 		if (ioth_setsockopt(fd[i], IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on)) < 0)
 			printlog(LOG_ERR, "setsockopt error udp port %d", args->item[i].extport);
+		/* if UDP_GRO is not supported, datagrams are simply received one by one */
+		if (args->item[i].udp_gro)
+			ioth_setsockopt(fd[i], SOL_UDP, UDP_GRO, &on, sizeof(on));
+		gso_ext[i] = gso_int[i] = 1;
+		if (conf_udp_busypoll > 0)
+			ioth_setsockopt(fd[i], SOL_SOCKET, SO_BUSY_POLL, &conf_udp_busypoll, sizeof(int));
 		epoll_ctl(epfd, EPOLL_CTL_ADD, fd[i],
 				&(struct epoll_event) {.events = EPOLLIN, .data.ptr = &fd[i]});
 		fdconn[i] = NULL;
+		pool[i] = args->item[i].udp_shared > 0 ? udppool_new(epfd, &args->item[i], i) : NULL;
 		usagecount++;
 	}
+	/* busy polling: after some traffic, spin using non-blocking epoll_wait
+		 for conf_udp_busypoll usecs before going back to sleep */
+	int spinning = 0;
+	long spin_deadline = 0;
+	long spin_us = 0;
 	while (usagecount > 0) {
 		struct epoll_event events[NEVENTS];
-		int nevents = epoll_wait(epfd, events, NEVENTS, 1000);
+		long spin_start = spinning ? monotonic_us() : 0;
+		int nevents = epoll_wait(epfd, events, NEVENTS, spinning ? 0 : 1000);
+		if (conf_udp_busypoll > 0) {
+			long now_us = monotonic_us();
+			if (spinning && nevents <= 0)
+				spin_us += now_us - spin_start;
+			if (nevents > 0) {
+				spinning = 1;
+				spin_deadline = now_us + conf_udp_busypoll;
+			} else if (spinning && now_us >= spin_deadline) {
+				spinning = 0;
+				otip_stats.udp_busypoll_us += spin_us;
+				spin_us = 0;
+			}
+		}
 		now = time(NULL);
 		for (int k = 0; k < nevents; k++) {
 			struct epoll_event *event = &events[k];
@@ -83,32 +326,73 @@ static void *udplisten(void * arg) {
 				//packet from ext to int
 				int i = extfd - fd;
 				struct sockaddr_in6 sender;
-				uint8_t buf[UDPBUFSIZE];
+				uint8_t rcvctlbuf[CMSG_PKTINFO_SIZE + CMSG_GRO_SIZE];
 				uint8_t ctlbuf[CMSG_PKTINFO_SIZE];
 				struct msghdr hdr = {
 					.msg_name = &sender,
 					.msg_namelen = sizeof(struct sockaddr_in6),
 					.msg_iov = & (struct iovec) {.iov_base = buf, .iov_len = UDPBUFSIZE},
 					.msg_iovlen = 1,
-					.msg_control = ctlbuf,
-					.msg_controllen = sizeof(ctlbuf)
+					.msg_control = rcvctlbuf,
+					.msg_controllen = sizeof(rcvctlbuf)
 				};
 				int n = recvmsg(fd[i], &hdr, 0);
-				if (n > 0) {
+				int segsize = 0;
+				/* the control buffer is valid only if a datagram was received */
+				size_t ctllen = (n > 0) ? udp_cmsg(&hdr, ctlbuf, &segsize) : 0;
+				if (n > 0 && pool[i] != NULL) {
+					/* shared mode: each request takes a free socket */
+					if (now > expire)
+						continue;
+					if (!ratelimit_check(&sender.sin6_addr)) {
+						otip_stats.ratelimited++;
+						continue;
+					}
+					struct udpconn *conn = udppool_get(pool[i]);
+					if (conn == NULL) {
+						otip_stats.udp_pool_full++;
+						continue;
+					}
+					pool[i]->busy++;
+					conn->busy = 1;
+					conn->start = now;
+					conn->start_ms = flowlog_now_ms();
+					conn->expire = now + conf_udp_timeout;
+					conn->sender = sender;
+					conn->ctllen = ctllen;
+					memcpy(conn->ctlbuf, ctlbuf, conn->ctllen);
+					conn->stat = (struct flowstat) {{0, 0}, {0, 0}};
+					flowstat_add(&conn->stat, FLOW_EXT2INT, n, udp_segments(n, segsize));
+					otip_stats.udp_flows++;
+					conn->intstack->sessions++;
+					conn->intstack->total++;
+					if (capturing())
+						udp_capture(fd[i], conn, &args->item[i], CAPTURE_EXT2INT, buf, n);
+					udp_send(conn->fd, NULL, NULL, 0, buf, n, segsize, &gso_int[i]);
+				} else if (n > 0) {
 					struct udpconn *conn;
 					for (conn = fdconn[i]; conn != NULL; conn = conn->next) {
 						if (conn->sender.sin6_port == sender.sin6_port &&
 								memcmp(&conn->sender.sin6_addr, &sender.sin6_addr, sizeof(struct in6_addr)) == 0 &&
-								hdr.msg_controllen == conn->ctllen &&
+								ctllen == conn->ctllen &&
 								memcmp(conn->ctlbuf, ctlbuf, conn->ctllen) == 0) {
 							break;
 						}
 					}
 					if (conn == NULL && now <= expire) {
-						conn = malloc(sizeof(*conn) + hdr.msg_controllen);
+						if (!ratelimit_check(&sender.sin6_addr)) {
+							otip_stats.ratelimited++;
+							continue;
+						}
+						conn = malloc(sizeof(*conn) + ctllen);
 						if (conn != NULL) {
-							conn->fd = ioth_msocket(args->intstack, AF_INET6, SOCK_DGRAM, 0);
+							conn->intstack = intstack_get(&sender, args->item[i].extport);
+							conn->fd = ioth_msocket(conn->intstack->stack, AF_INET6, SOCK_DGRAM, 0);
 							ioth_connect(conn->fd, (struct sockaddr *) &args->item[i].intsockaddr, sizeof(struct sockaddr_in6));
+							if (args->item[i].udp_gro)
+								ioth_setsockopt(conn->fd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+							if (conf_udp_busypoll > 0)
+								ioth_setsockopt(conn->fd, SOL_SOCKET, SO_BUSY_POLL, &conf_udp_busypoll, sizeof(int));
 							int retval = epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd,
 									&(struct epoll_event) {.events = EPOLLIN, .data.ptr = conn});
 							if (retval < 0) {
@@ -116,58 +400,115 @@ static void *udplisten(void * arg) {
 								free(conn);
 							} else {
 								conn->i = i;
+								conn->start = now;
+								conn->start_ms = flowlog_now_ms();
 								conn->sender = sender;
 								conn->next = fdconn[i];
-								conn->ctllen = hdr.msg_controllen;
+								conn->ctllen = ctllen;
 								memcpy(conn->ctlbuf, ctlbuf, conn->ctllen);
+								conn->stat = (struct flowstat) {{0, 0}, {0, 0}};
 								fdconn[i] = conn;
+								otip_stats.udp_flows++;
+								conn->intstack->sessions++;
+								conn->intstack->total++;
 							}
 						}
 					}
 					if (conn != NULL) {
-						send(conn->fd, buf, n, 0);
+						flowstat_add(&conn->stat, FLOW_EXT2INT, n, udp_segments(n, segsize));
+						if (capturing())
+							udp_capture(fd[i], conn, &args->item[i], CAPTURE_EXT2INT, buf, n);
+						udp_send(conn->fd, NULL, NULL, 0, buf, n, segsize, &gso_int[i]);
 						conn->expire = now + conf_udp_timeout;
 					}
 				}
 			} else {
 				//packet fron int to ext
 				struct udpconn *conn = event->data.ptr;
-				uint8_t buf[UDPBUFSIZE];
-				ssize_t n = recv(conn->fd, buf, UDPBUFSIZE, 0);
-				struct msghdr hdr = {
-					.msg_name = &conn->sender,
-					.msg_namelen = sizeof(struct sockaddr_in6),
-					.msg_iov = & (struct iovec) {.iov_base = buf, .iov_len = n},
+				uint8_t rcvctlbuf[CMSG_GRO_SIZE];
+				struct msghdr rcvhdr = {
+					.msg_iov = & (struct iovec) {.iov_base = buf, .iov_len = UDPBUFSIZE},
 					.msg_iovlen = 1,
-					.msg_control = conn->ctlbuf,
-					.msg_controllen = conn->ctllen
+					.msg_control = rcvctlbuf,
+					.msg_controllen = sizeof(rcvctlbuf)
 				};
-				sendmsg(fd[conn->i], &hdr, 0);
+				ssize_t n = recvmsg(conn->fd, &rcvhdr, 0);
+				/* late reply on a shared socket: no client is waiting for it */
+				if (n < 0 || (conn->shared && !conn->busy))
+					continue;
+				int segsize = 0;
+				if (rcvhdr.msg_controllen > 0) {
+					uint8_t unused[CMSG_PKTINFO_SIZE];
+					udp_cmsg(&rcvhdr, unused, &segsize);
+				}
+				if (capturing())
+					udp_capture(fd[conn->i], conn, &args->item[conn->i], CAPTURE_INT2EXT, buf, n);
+				udp_send(fd[conn->i], &conn->sender, conn->ctlbuf, conn->ctllen,
+						buf, n, segsize, &gso_ext[conn->i]);
+				flowstat_add(&conn->stat, FLOW_INT2EXT, n, udp_segments(n, segsize));
 				conn->expire = now + conf_udp_timeout;
+				if (conn->shared) {
+					udp_flowlog(args, conn, FLOW_END_CLOSED);
+					udppool_release(pool[conn->i], conn);
+				}
 			}
 		}
 		if (now > last) {
 			//printf("cleanudp\n");
+			int reaped = extstack_reaped(args);
+			if (reaped)
+				expire = 0;
 			for (int i = 0; i < args->size; i++) {
 				for (struct udpconn **scan = &fdconn[i]; *scan != NULL; ) {
 					struct udpconn *conn = *scan;
+					int reason = FLOW_END_IDLE;
+					if (reaped ||
+							(conf_session_maxage > 0 && now - conn->start >= conf_session_maxage)) {
+						conn->expire = 0;
+						reason = reaped ? FLOW_END_FORCED : FLOW_END_ACTIVE;
+						otip_stats.sessions_reaped++;
+					}
 					if (now > conn->expire) {
+						udp_flowlog(args, conn, reason);
+						epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
 						ioth_close(conn->fd);
-						epoll_ctl(epfd, conn->fd, EPOLL_CTL_DEL, NULL);
 						*scan = conn->next;
+						otip_stats.udp_flows--;
+						conn->intstack->sessions--;
 						free(conn);
 					} else
 						scan = &(conn->next);
 				}
-				if (now > expire && fdconn[i] == NULL) {
-					epoll_ctl(epfd, fd[i], EPOLL_CTL_DEL, NULL);
+				if (pool[i] != NULL) {
+					for (int k = 0; k < pool[i]->size; k++) {
+						struct udpconn *conn = pool[i]->conn[k];
+						/* no reply: release the socket */
+						if (conn->busy && (reaped || now > conn->expire)) {
+							udp_flowlog(args, conn, reaped ? FLOW_END_FORCED : FLOW_END_IDLE);
+							if (!reaped)
+								udppool_renew(epfd, &args->item[i], conn);
+							udppool_release(pool[i], conn);
+						}
+					}
+				}
+				if (now > expire && fdconn[i] == NULL && fd[i] >= 0 &&
+						(pool[i] == NULL || pool[i]->busy == 0)) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, fd[i], NULL);
 					ioth_close(fd[i]);
+					fd[i] = -1;
+					if (pool[i] != NULL) {
+						udppool_free(epfd, pool[i]);
+						pool[i] = NULL;
+					}
 					usagecount--;
 				}
 			}
 			last = now;
 		}
 	}
+	otip_stats.udp_busypoll_us += spin_us;
+	close(epfd);
+	free(buf);
 	extstack_usagedown(args);
 	free(args);
 	return NULL;
@@ -175,10 +516,15 @@ static void *udplisten(void * arg) {
 
 void proxyudp(struct connarg *connarg) {
 	struct connarg *udpconn = malloc(sizeof(struct connarg));
+	if (udpconn == NULL)
+		return;
 	*udpconn = *connarg;
-	pthread_t p;
 	extstack_usageup(udpconn);
-	if (pthread_create(&p, NULL, udplisten, (void *) udpconn) < 0)
+	int retval = spawn_thread(udplisten, udpconn);
+	if (retval != 0) {
+		printlog(LOG_ERR, "cannot create udp listener thread: %s", strerror(retval));
 		extstack_usagedown(udpconn);
+		free(udpconn);
+	}
 	return;
 }
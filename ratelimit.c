@@ -0,0 +1,161 @@
+/*
+ *   ratelimit.c: tcp/udp reverse proxy for otip: per source rate limiting
+ *
+ *   Copyright 2022 Renzo Davoli - Virtual Square Team
+ *   University of Bologna - Italy
+ *
+ * otip_rproxy is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ratelimit.h>
+
+/* Each limiter (one for /128 source addresses, one for /64 source networks)
+ * is an open addressing hash table of token buckets.
+ * Tokens are counted in thousandths, time in milliseconds.
+ * A bucket idle for longer than the time needed to refill it is equivalent
+ * to an empty slot, so expired entries are simply overwritten.
+ * The table is split in stripes, each one protected by its own lock:
+ * a key is always searched in the NPROBE slots following its hash
+ * position, all in the same stripe.
+ * Live buckets are never evicted (a source could reset its own limit by
+ * flooding the table with spoofed addresses): when all the slots of the
+ * probe window are in use, the new source shares the overflow bucket of
+ * the stripe. */
+
+#define RL_SIZE 8192
+#define RL_STRIPES 64
+#define RL_STRIPESIZE (RL_SIZE / RL_STRIPES)
+#define NPROBE 8
+#define MILLI 1000
+
+struct bucket {
+	uint64_t key[2];
+	uint32_t last;
+	uint32_t tokens;
+};
+
+struct ratelimit {
+	int prefixlen;
+	uint32_t rate;   /* tokens/sec */
+	uint32_t burst;  /* in thousandths of token */
+	uint32_t expire; /* msecs to refill the bucket */
+	pthread_mutex_t lock[RL_STRIPES];
+	struct bucket overflow[RL_STRIPES];
+	struct bucket table[RL_SIZE];
+};
+
+static struct ratelimit *rl_addr;
+static struct ratelimit *rl_net;
+
+static uint32_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int ratelimit_set(int prefixlen, const char *spec) {
+	struct ratelimit **rlp = (prefixlen == 64) ? &rl_net : &rl_addr;
+	char *tail;
+	unsigned long rate = strtoul(spec, &tail, 0);
+	unsigned long burst = rate;
+	if (*tail == '/')
+		burst = strtoul(tail + 1, &tail, 0);
+	if (*tail != 0 || rate == 0 || burst == 0)
+		return -1;
+	struct ratelimit *rl = calloc(1, sizeof(*rl));
+	if (rl == NULL)
+		return -1;
+	rl->prefixlen = prefixlen;
+	rl->rate = rate;
+	rl->burst = burst * MILLI;
+	rl->expire = (burst * 1000 + rate - 1) / rate;
+	uint32_t now = now_ms();
+	for (int i = 0; i < RL_STRIPES; i++) {
+		pthread_mutex_init(&rl->lock[i], NULL);
+		rl->overflow[i].last = now;
+		rl->overflow[i].tokens = rl->burst;
+	}
+	/* empty slots must look expired */
+	for (int i = 0; i < RL_SIZE; i++)
+		rl->table[i].last = now - rl->expire;
+	free(*rlp);
+	*rlp = rl;
+	return 0;
+}
+
+static inline uint64_t rl_hash(uint64_t key[2]) {
+	uint64_t h = key[0] * 0x9e3779b97f4a7c15ULL;
+	h ^= key[1] + (h >> 29);
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return h ^ (h >> 32);
+}
+
+static int rl_check(struct ratelimit *rl, const struct in6_addr *addr, uint32_t now) {
+	uint64_t key[2];
+	memcpy(key, addr, sizeof(key));
+	if (rl->prefixlen == 64)
+		key[1] = 0;
+	uint64_t h = rl_hash(key);
+	int stripe = h % RL_STRIPES;
+	int base = stripe * RL_STRIPESIZE;
+	int start = (h / RL_STRIPES) % RL_STRIPESIZE;
+	struct bucket *victim = NULL;
+	int allowed;
+	pthread_mutex_lock(&rl->lock[stripe]);
+	for (int i = 0; i < NPROBE; i++) {
+		struct bucket *b = &rl->table[base + (start + i) % RL_STRIPESIZE];
+		if (b->key[0] == key[0] && b->key[1] == key[1] && now - b->last < rl->expire) {
+			victim = b;
+			break;
+		}
+		/* keep the first expired slot */
+		if (victim == NULL && now - b->last >= rl->expire)
+			victim = b;
+	}
+	struct bucket *b = (victim != NULL) ? victim : &rl->overflow[stripe];
+	if (b == victim && (b->key[0] != key[0] || b->key[1] != key[1] || now - b->last >= rl->expire)) {
+		/* new or expired entry: full bucket */
+		b->key[0] = key[0];
+		b->key[1] = key[1];
+		b->tokens = rl->burst;
+	} else {
+		uint64_t tokens = b->tokens + (uint64_t) (now - b->last) * rl->rate;
+		b->tokens = tokens > rl->burst ? rl->burst : tokens;
+	}
+	b->last = now;
+	if ((allowed = (b->tokens >= MILLI)))
+		b->tokens -= MILLI;
+	pthread_mutex_unlock(&rl->lock[stripe]);
+	return allowed;
+}
+
+int ratelimit_check(const struct in6_addr *addr) {
+	uint32_t now;
+	if (rl_addr == NULL && rl_net == NULL)
+		return 1;
+	now = now_ms();
+	if (rl_addr != NULL && !rl_check(rl_addr, addr, now))
+		return 0;
+	if (rl_net != NULL && !rl_check(rl_net, addr, now))
+		return 0;
+	return 1;
+}
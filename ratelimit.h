@@ -0,0 +1,12 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+#include <netinet/in.h>
+
+/* token bucket rate limiting of new sessions, keyed by source address.
+ * spec is <rate>[/<burst>]: sessions per second, max burst (default: rate) */
+int ratelimit_set(int prefixlen, const char *spec);
+
+/* return 1 if a new session from addr is allowed, 0 otherwise */
+int ratelimit_check(const struct in6_addr *addr);
+
+#endif
@@ -0,0 +1,152 @@
+#!/bin/sh
+#
+#   stress_rotation.sh: check that stack rotation does not leak resources
+#
+#   Copyright 2022 Renzo Davoli - Virtual Square Team
+#   University of Bologna - Italy
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; If not, see <http://www.gnu.org/licenses/>.
+#
+# Run otip_rproxy with a short OTIP period while clients keep long and
+# short tcp sessions and udp flows open across the period boundaries,
+# then check the --stats lines: the number of alive stacks must stay
+# within (lifetime / period + 1) plus the stacks kept by the long sessions,
+# file descriptors, threads and resident memory must not keep growing
+# (the maximum in the second half of the run is compared with the
+# maximum in the first half).
+#
+# The script must run where the OTIP addresses of the external stack are
+# reachable and the servers of the mappings are running (e.g. in a vdens
+# connected to the vde hub of extstack, using example/otip_rproxy.rc with
+# example/udp_echo.py and a tcp echo server on port 8484).
+#
+# usage: test/stress_rotation.sh [rcfile]
+# environment: OTIP_RPROXY, OTIPADDR (programs), NC (netcat supporting -6 -u -w),
+#   DURATION (seconds, default 120), PERIOD (OTIP period, default 2),
+#   LONG (number of long sessions, default 4), PORT (default: first tcp mapping),
+#   UDPPORT (default: first udp mapping)
+
+RCFILE=${1:-example/otip_rproxy.rc}
+OTIP_RPROXY=${OTIP_RPROXY:-otip_rproxy}
+OTIPADDR=${OTIPADDR:-otipaddr}
+NC=${NC:-nc}
+DURATION=${DURATION:-120}
+PERIOD=${PERIOD:-2}
+LONG=${LONG:-4}
+PREACTIVE=1
+POSTACTIVE=1
+
+rcvalue() {
+	awk -v tag="$1" '$1 == tag {print $2; exit}' "$RCFILE"
+}
+
+NAME=$(rcvalue name)
+DNS=$(rcvalue dns)
+PASSWD=$(rcvalue passwd)
+BASE=$(rcvalue baseaddr)
+PORT=${PORT:-$(rcvalue tcp | cut -d, -f1)}
+UDPPORT=${UDPPORT:-$(rcvalue udp | cut -d, -f1)}
+if [ -z "$NAME" ] || [ -z "$PASSWD" ] || [ -z "$PORT" ]; then
+	echo "$RCFILE: name, passwd and a tcp mapping are required" >&2
+	exit 2
+fi
+
+LOG=$(mktemp)
+# stop otip_rproxy and the clients still running
+cleanup() {
+	pkill -P $$ 2>/dev/null
+	rm -f "$LOG"
+}
+trap cleanup EXIT
+trap 'exit 2' INT TERM
+
+currentaddr() {
+	"$OTIPADDR" ${BASE:+-b "$BASE"} ${DNS:+-D "$DNS"} -T "$PERIOD" "$NAME" "$PASSWD"
+}
+
+"$OTIP_RPROXY" -f "$RCFILE" --otip_period "$PERIOD" --otip_preactive "$PREACTIVE" \
+	--otip_postactive "$POSTACTIVE" --stats 1 2> "$LOG" &
+PROXY=$!
+sleep "$PERIOD"
+
+# long sessions: opened at different epochs, closed at the end of the run
+for i in $(seq "$LONG"); do
+	sleep "$DURATION" | "$NC" -6 "$(currentaddr)" "$PORT" > /dev/null 2>&1 &
+	sleep "$PERIOD"
+done
+
+# short sessions and udp flows, across the period boundaries
+END=$(($(date +%s) + DURATION))
+while [ "$(date +%s)" -lt "$END" ]; do
+	ADDR=$(currentaddr)
+	echo stress | timeout 3 "$NC" -6 -w 1 "$ADDR" "$PORT" > /dev/null 2>&1 &
+	if [ -n "$UDPPORT" ]; then
+		echo stress | timeout 2 "$NC" -6 -u -w 1 "$ADDR" "$UDPPORT" > /dev/null 2>&1 &
+	fi
+	sleep 0.3
+done
+sleep "$POSTACTIVE"
+
+if ! kill -0 "$PROXY" 2>/dev/null; then
+	echo "otip_rproxy terminated:" >&2
+	cat "$LOG" >&2
+	exit 1
+fi
+
+# check the stats lines, e.g.:
+# otip_rproxy: stats: stacks 3 (created 57 freed 54 reaped 0) ... rss 10748kB fds 31 threads 19 ...
+LIFETIME=$((PERIOD + PREACTIVE + POSTACTIVE))
+MAXSTACKS=$(((LIFETIME + PERIOD - 1) / PERIOD + 1 + LONG))
+grep 'stats: stacks' "$LOG" | awk -v maxstacks="$MAXSTACKS" '
+function field(tag,   i) {
+	for (i = 1; i < NF; i++)
+		if ($i == tag) return $(i + 1) + 0;
+	return -1;
+}
+{
+	stacks[NR] = field("stacks"); rss[NR] = field("rss");
+	fds[NR] = field("fds"); threads[NR] = field("threads");
+}
+function max(v, from, to,   i, m) {
+	m = 0;
+	for (i = from; i <= to; i++) if (v[i] > m) m = v[i];
+	return m;
+}
+function check(name, v, slack, percent,   first, second) {
+	first = max(v, 1, int(NR / 2));
+	second = max(v, int(NR / 2) + 1, NR);
+	printf("%-8s first half max %d, second half max %d\n", name, first, second);
+	if (second > first + slack + first * percent / 100) {
+		printf("%s: unbounded growth\n", name);
+		fail = 1;
+	}
+}
+END {
+	if (NR < 10) {
+		print "not enough stats lines";
+		exit 1;
+	}
+	if (max(stacks, 1, NR) > maxstacks) {
+		printf("stacks: %d alive stacks, max expected %d\n", max(stacks, 1, NR), maxstacks);
+		fail = 1;
+	}
+	check("stacks", stacks, 1, 0);
+	check("fds", fds, 8, 10);
+	check("threads", threads, 8, 10);
+	check("rss", rss, 1024, 25);
+	exit fail;
+}'
+RESULT=$?
+[ $RESULT -eq 0 ] && echo "PASS" || echo "FAIL"
+exit $RESULT
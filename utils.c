@@ -34,6 +34,9 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
 
 static int logok=0;
 static char *progname;
@@ -95,6 +98,101 @@ void save_pidfile(char *pidfile, char *cwd)
 	fclose(f);
 }
 
+/* read resident set size and thread count from /proc/self/status,
+ * count the open file descriptors in /proc/self/fd */
+int procstat(struct procstat *ps) {
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL) return -1;
+	char *line = NULL;
+	size_t len;
+	ps->rss_kb = ps->threads = ps->fds = 0;
+	while (getline(&line, &len, f) > 0) {
+		if (strncmp(line, "VmRSS:", 6) == 0)
+			ps->rss_kb = strtol(line + 6, NULL, 10);
+		else if (strncmp(line, "Threads:", 8) == 0)
+			ps->threads = strtol(line + 8, NULL, 10);
+	}
+	fclose(f);
+	if (line) free(line);
+	DIR *d = opendir("/proc/self/fd");
+	if (d == NULL) return -1;
+	while (readdir(d) != NULL)
+		ps->fds++;
+	closedir(d);
+	ps->fds -= 3; /* ".", ".." and the fd of opendir itself */
+	return 0;
+}
+
+/* parse a cpu list: e.g. 0-3,8,10-11 */
+int parse_cpulist(const char *list, cpu_set_t *set) {
+	CPU_ZERO(set);
+	while (*list) {
+		char *end;
+		long first = strtol(list, &end, 10);
+		long last = first;
+		if (end == list)
+			return -1;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list)
+				return -1;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+		for (long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, set);
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		list = end;
+	}
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/* stack size and cpu set of the threads created by spawn_thread */
+static size_t spawn_stacksize;
+static cpu_set_t spawn_cpuset;
+static int spawn_cpuset_valid;
+
+void spawn_thread_attr(size_t stacksize, const cpu_set_t *cpuset) {
+	spawn_stacksize = stacksize;
+	if (stacksize > 0 && stacksize < (size_t) PTHREAD_STACK_MIN)
+		spawn_stacksize = PTHREAD_STACK_MIN;
+	if (cpuset != NULL)
+		spawn_cpuset = *cpuset;
+	spawn_cpuset_valid = (cpuset != NULL);
+}
+
+/* threads are never joined: create them detached, so that their
+ * resources are released as soon as they terminate.
+ * The signals handled by the main thread are blocked in the new thread
+ * (it inherits the signal mask): they must not interrupt the relay loops */
+int spawn_thread(void *(*start_routine)(void *), void *arg) {
+	pthread_t p;
+	pthread_attr_t attr;
+	sigset_t mask, oldmask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (spawn_stacksize > 0)
+		pthread_attr_setstacksize(&attr, spawn_stacksize);
+	int retval = 0;
+	if (spawn_cpuset_valid)
+		retval = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &spawn_cpuset);
+	if (retval == 0)
+		retval = pthread_create(&p, &attr, start_routine, arg);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	return retval;
+}
+
 void packetdump(FILE *f, void *arg,ssize_t len) {
 	unsigned char *buf=arg;
 	ssize_t lines=(len+15)>>4;
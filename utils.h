@@ -4,11 +4,24 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <syslog.h>
+#include <sched.h>
 
 void startlog(char *prog, int use_syslog);
 void printlog(int priority, const char *format, ...);
 void save_pidfile(char *pidfile, char *cwd);
 
+struct procstat {
+	long rss_kb;
+	int threads;
+	int fds;
+};
+int procstat(struct procstat *ps);
+
+int parse_cpulist(const char *list, cpu_set_t *set);
+/* stacksize 0: default; cpuset NULL: no affinity */
+void spawn_thread_attr(size_t stacksize, const cpu_set_t *cpuset);
+int spawn_thread(void *(*start_routine)(void *), void *arg);
+
 void packetdump(FILE *f, void *arg,ssize_t len);
 void printin6addr(FILE *f, void *addr);
 